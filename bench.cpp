@@ -0,0 +1,154 @@
+#include "extsort/cmd.hpp"
+#include "extsort/extsort.hpp"
+#include "extsort/test.hpp"
+#include "extsort/timer.hpp"
+#include "extsort/metrics.hpp"
+#include "extsort/engine.hpp"
+#include <thread>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmark harness: generates inputs of given distributions and sorts each one
+//   with every combination of engine, mode, threads and memory limit.
+// Result table is csv, one row per run, see 'header' below.
+
+static std::vector<std::string> split(const std::string& list)
+{
+  std::vector<std::string> res;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (!item.empty())
+      res.push_back(item);
+  return res;
+}
+
+// Number of elements with optional K/M/G suffix, e.g. "16M".
+static size_t parseCount(const std::string& s)
+{
+  size_t pos = 0;
+  size_t n = std::stoull(s, &pos);
+  if (pos < s.size())
+    switch (s[pos]) {
+    case 'K': case 'k': n <<= 10; break;
+    case 'M': case 'm': n <<= 20; break;
+    case 'G': case 'g': n <<= 30; break;
+    }
+  return n;
+}
+
+// Mode names: 'par' multithread merge, 'pN' N merge passes, 'sN' N merge slots.
+static bool runMode(const std::string& mode, const std::string& input, const std::string& output,
+  size_t memSize, int numThreads)
+{
+  if (mode == "par")
+    externalSortNPasses(input, output, memSize, numThreads, 0);
+  else if (mode.size() > 1 && mode[0] == 'p')
+    externalSortNPasses(input, output, memSize, numThreads, std::stoi(mode.substr(1)));
+  else if (mode.size() > 1 && mode[0] == 's')
+    externalSort(input, output, memSize, numThreads, std::stoi(mode.substr(1)));
+  else
+    return false;
+  return true;
+}
+
+int main(int argc, const char* argv[])
+{
+  CmdOptions cmd(argc, argv);
+  if (cmd.exists_option("--help")) {
+    std::cout << "extsort_bench [-n 16M] [-dist uniform,sorted,...] [-engines all|pool-std-buffered,...] [-modes par,p1,p2,s8] [-t 1,4] [-m 4M] [-o bench.csv] [--verify] [--verbose]\n";
+    return 0;
+  }
+
+  const int hw = int(std::thread::hardware_concurrency());
+  const size_t size = parseCount(cmd.get_option("-n", "16M"));
+  auto dists = split(cmd.get_option("-dist"));
+  if (dists.empty())
+    dists = distributionNames();
+  auto engineNames = split(cmd.get_option("-engines", engines().front().name));
+  if (engineNames.size() == 1 && engineNames[0] == "all") {
+    engineNames.clear();
+    for (auto& engine : engines())
+      engineNames.push_back(engine.name);
+  }
+  for (auto& name : engineNames)
+    if (!selectEngine(name)) {
+      std::cerr << "Unknown engine: " << name << "\n";
+      return 1;
+    }
+  const auto modes = split(cmd.get_option("-modes", "par,p1,p2"));
+  std::vector<int> threads;
+  for (auto& t : split(cmd.get_option("-t", "1," + std::to_string(hw))))
+    threads.push_back(std::stoi(t));
+  std::vector<size_t> mems;
+  for (auto& m : split(cmd.get_option("-m", "4M")))
+    mems.push_back(parseCount(m));
+  const bool verify = cmd.exists_option("--verify");
+  const bool verbose = cmd.exists_option("--verbose");
+
+  const std::string input = "bench_input";
+  const std::string output = "bench_output";
+  const std::string header = "dist,engine,mode,threads,mem_elements,elements,sec,mb_per_sec,peak_rss_mb,"
+    "run_generation_sec,merge_phase_sec,read_sum_sec,sort_sum_sec,write_sum_sec,wait_sum_sec,verified";
+  std::ofstream csv;
+  if (cmd.exists_option("-o"))
+    csv.open(cmd.get_option("-o"));
+  if (csv)
+    csv << header << "\n";
+  std::cout << header << "\n";
+
+  Metrics::get().enable();
+  int failed = 0;
+  for (auto& distName : dists) {
+    Distribution dist;
+    if (!parseDistribution(distName, dist)) {
+      std::cerr << "Unknown distribution: " << distName << "\n";
+      return 1;
+    }
+    Timer timerGen;
+    generateFile(input, size, dist, hw);
+    std::cerr << "Generated " << distName << " " << size << " elements: " << timerGen << "sec.\n";
+    for (auto& engine : engineNames)
+      for (auto& mode : modes)
+        for (auto t : threads)
+          for (auto mem : mems) {
+            selectEngine(engine);
+            Metrics::get().reset();
+            Metrics::resetPeakRss();
+            auto coutBuf = std::cout.rdbuf();
+            if (!verbose)
+              std::cout.rdbuf(nullptr); // Mute engine logs, keep stdout for the table.
+            Timer timer;
+            bool ok = runMode(mode, input, output, mem * sizeof(unsigned), t);
+            double sec = timer;
+            const auto rss = Metrics::peakRss();
+            auto spans = Metrics::get().spanTotals();
+            std::cout.rdbuf(coutBuf);
+            std::cout.clear();
+            if (!ok) {
+              std::cerr << "Unknown mode: " << mode << "\n";
+              return 1;
+            }
+            std::string verified = "-";
+            if (verify) {
+              verified = makeTest(input, output) ? "ok" : "FAILED";
+              failed += verified != "ok";
+            }
+            const double mb = double(size * sizeof(unsigned)) / (1024.0 * 1024.0);
+            std::stringstream row;
+            row << distName << "," << engine << "," << mode << "," << t << "," << mem << "," << size << ","
+              << sec << "," << mb / sec << "," << double(rss) / (1024.0 * 1024.0) << ","
+              << spans["run generation"] << "," << spans["merge phase"] << "," << spans["read"] << ","
+              << spans["sort"] << "," << spans["write"] << "," << spans["wait"] << "," << verified;
+            std::cout << row.str() << std::endl;
+            if (csv)
+              csv << row.str() << "\n";
+          }
+  }
+  std::remove(input.data());
+  std::remove(output.data());
+  return failed ? 1 : 0;
+}
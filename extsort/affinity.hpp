@@ -0,0 +1,223 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <climits>
+#include <cstdlib>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// Cpus available to the process and their NUMA nodes.
+// Pinning is just a hint: where the platform has no support all of this falls back
+//   to a single node and 'pinThread' does nothing.
+class CpuTopology
+{
+public:
+
+  static const CpuTopology& get()
+  {
+    static const CpuTopology topo;
+    return topo;
+  }
+
+  const std::vector<int>& cpus() const { return m_cpus; }
+  int numNodes() const { return m_numNodes; }
+  int nodeOf(int cpu) const { return cpu < m_nodeOf.size() ? m_nodeOf[cpu] : 0; }
+
+  std::vector<int> nodeCpus(int node) const
+  {
+    std::vector<int> res;
+    for (auto c : m_cpus)
+      if (nodeOf(c) == node)
+        res.push_back(c);
+    return res;
+  }
+
+  // Cpus interleaved by node, so the first N workers are spread over all sockets evenly.
+  std::vector<int> spreadOrder() const
+  {
+    std::vector<std::vector<int>> perNode(m_numNodes);
+    for (auto c : m_cpus)
+      perNode[nodeOf(c)].push_back(c);
+    std::vector<int> res;
+    res.reserve(m_cpus.size());
+    for (size_t i = 0; res.size() < m_cpus.size(); i++)
+      for (auto& n : perNode)
+        if (i < n.size())
+          res.push_back(n[i]);
+    return res;
+  }
+
+private:
+
+  CpuTopology()
+  {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &set))
+          m_cpus.push_back(c);
+    for (int node = 0, misses = 0; misses < 8; node++) {
+      std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      std::string list;
+      if (!(f >> list)) {
+        misses++; // Node ids may have gaps.
+        continue;
+      }
+      misses = 0;
+      for (auto c : parseCpuList(list)) {
+        if (c >= m_nodeOf.size())
+          m_nodeOf.resize(c + 1, 0);
+        m_nodeOf[c] = node;
+      }
+    }
+#elif defined(_WIN32)
+    DWORD_PTR procMask = 0, sysMask = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &procMask, &sysMask))
+      for (int c = 0; c < int(sizeof(procMask) * 8); c++)
+        if (procMask & (DWORD_PTR(1) << c)) {
+          m_cpus.push_back(c);
+          UCHAR node = 0;
+          if (GetNumaProcessorNode(UCHAR(c), &node) && node != 0xFF) {
+            if (c >= m_nodeOf.size())
+              m_nodeOf.resize(c + 1, 0);
+            m_nodeOf[c] = node;
+          }
+        }
+#endif
+    if (m_cpus.empty())
+      for (int c = 0; c < int(std::max(1u, std::thread::hardware_concurrency())); c++)
+        m_cpus.push_back(c);
+    // Renumber nodes densely, so nodes without our cpus do not count.
+    std::vector<int> used;
+    for (auto c : m_cpus)
+      used.push_back(nodeOf(c));
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    for (auto& n : m_nodeOf)
+      n = int(std::lower_bound(used.begin(), used.end(), n) - used.begin());
+    m_numNodes = int(used.size());
+  }
+
+  // Linux format is like "0-3,8-11".
+  static std::vector<int> parseCpuList(const std::string& list)
+  {
+    std::vector<int> res;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      auto dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int c = first; c <= last; c++)
+        res.push_back(c);
+    }
+    return res;
+  }
+
+  std::vector<int> m_cpus;
+  std::vector<int> m_nodeOf; // By cpu id.
+  int m_numNodes = 1;
+};
+
+// Restrict the calling thread to the given cpus. Threads created later by it inherit the mask.
+inline bool pinThread(const std::vector<int>& cpus)
+{
+  if (cpus.empty())
+    return false;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto c : cpus)
+    CPU_SET(c, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+  DWORD_PTR mask = 0;
+  for (auto c : cpus)
+    if (c < int(sizeof(mask) * 8))
+      mask |= DWORD_PTR(1) << c;
+  return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+  return false;
+#endif
+}
+
+// Pin the calling thread for the scope, restore the previous mask on exit.
+class ScopedPin
+{
+public:
+
+  explicit ScopedPin(const std::vector<int>& cpus)
+  {
+#if defined(__linux__)
+    saved = pthread_getaffinity_np(pthread_self(), sizeof(old), &old) == 0;
+#endif
+    pinThread(cpus);
+  }
+
+  ~ScopedPin()
+  {
+#if defined(__linux__)
+    if (saved)
+      pthread_setaffinity_np(pthread_self(), sizeof(old), &old);
+#elif defined(_WIN32)
+    pinThread(CpuTopology::get().cpus());
+#endif
+  }
+
+private:
+#if defined(__linux__)
+  cpu_set_t old;
+  bool saved = false;
+#endif
+};
+
+// NUMA node the block device holding 'path' is attached to, -1 if unknown.
+// Only Linux exposes it, over sysfs of the device or of its parent for partitions.
+inline int deviceNode(const std::string& path)
+{
+#if defined(__linux__)
+  struct stat st;
+  if (::stat(path.data(), &st) != 0)
+    return -1;
+  auto dev = "/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+  char real[PATH_MAX];
+  if (!::realpath(dev.data(), real))
+    return -1;
+  std::string dir = real;
+  for (int up = 0; up < 2 && !dir.empty(); up++) {
+    for (auto sub : { "/device/numa_node", "/device/device/numa_node" }) {
+      std::ifstream f(dir + sub);
+      int node = -1;
+      if (f >> node && node >= 0) {
+        // Map to the dense numbering of CpuTopology over any cpu of this node.
+        std::ifstream cl("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (cl >> list) {
+          auto c = std::stoi(list);
+          return CpuTopology::get().nodeOf(c);
+        }
+        return -1;
+      }
+    }
+    dir = dir.substr(0, dir.rfind('/'));
+  }
+#endif
+  (void)path;
+  return -1;
+}
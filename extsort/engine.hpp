@@ -0,0 +1,221 @@
+#pragma once
+#include "thread_pool.hpp"
+#include "file.hpp"
+#include "index.hpp"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+// Policies the sort engine is assembled from. An engine is one combination of them:
+//   its hot paths are instantiated for it at compile time, and it is selected at runtime by name, see Engine.
+
+// Same interface as ThreadPool, but a job runs in the calling thread by 'start'; 'init' is called there once.
+template<class Data, class Function>
+class InlinePool
+{
+public:
+
+  class Worker
+  {
+  public:
+    Data& setup() { return data; }
+    void start() { func(data); }
+  private:
+    friend class InlinePool;
+    Function* func = nullptr;
+    Data data;
+  };
+
+  InlinePool(int, Function f, std::function<void(int, Data&)> init = nullptr)
+  {
+    worker.func = f;
+    if (init)
+      init(0, worker.data);
+  }
+
+  Worker& waitFree() { return worker; }
+  void terminate() {}
+  double mainWaits() const { return 0.0; }
+
+private:
+
+  Worker worker;
+};
+
+// Plain writes by the calling thread over a buffer; same interface as FileWriteBuf.
+template<class T>
+class FileWrite
+{
+public:
+
+  FileWrite(const std::string& name, size_t sz = 256 * 1024, long long at = -1, bool hashed = false) :
+    file(name, at < 0 ? "wb"s : "r+b"s),
+    hashed(hashed)
+  {
+    if (at >= 0)
+      file.seek(size_t(at));
+    buf.reserve(sz);
+  }
+
+  ~FileWrite() { close(); }
+
+  void close()
+  {
+    flush();
+    file.close();
+  }
+
+  void push_back(const T x)
+  {
+    buf.push_back(x);
+    if (buf.size() == buf.capacity())
+      flush();
+  }
+
+  size_t size() const { return written; }
+  uint64_t checksum() const { return hash; }
+
+private:
+
+  void flush()
+  {
+    if (buf.empty())
+      return;
+    if (hashed)
+      hash = ::checksum(buf.data(), buf.size() * sizeof(T), hash);
+    written += file.write(buf);
+    buf.clear();
+  }
+
+  File file;
+  bool hashed;
+  size_t written = 0;
+  uint64_t hash = ::checksum(nullptr, 0);
+  std::vector<NoInit<T>> buf;
+};
+
+// Threading model: pieces are sorted by a pool while the main thread reads next ones, merges of the first pass run in parallel.
+// Merge outputs are double buffered, written by a helper thread.
+struct PoolThreads
+{
+  static const char* name() { return "pool"; }
+  static const bool threaded = true;
+  template<class Data, class Function> using Pool = ThreadPool<Data, Function>;
+  template<class T> using Writer = FileWriteBuf<T>;
+};
+
+// Threading model: pieces are read, sorted and written in turn by the calling thread, one merge at a time,
+//   which writes its output too. Only BufferedReads adds threads, loaders of merge inputs.
+struct SingleThread
+{
+  static const char* name() { return "single"; }
+  static const bool threaded = false;
+  template<class Data, class Function> using Pool = InlinePool<Data, Function>;
+  template<class T> using Writer = FileWrite<T>;
+};
+
+// Sort kernel of pieces: std::sort.
+struct StdSort
+{
+  static const char* name() { return "std"; }
+  static void sort(unsigned* first, unsigned* last) { std::sort(first, last); }
+};
+
+// Sort kernel of pieces: in-place MSD radix sort by bytes from the highest one (American flag sort),
+//   small buckets by std::sort. No extra memory, so pieces are as large as with std::sort.
+struct RadixSort
+{
+  static const char* name() { return "radix"; }
+  static void sort(unsigned* first, unsigned* last, int shift = 24)
+  {
+    if (last - first <= 64) {
+      std::sort(first, last);
+      return;
+    }
+    size_t count[256] = {};
+    for (auto p = first; p != last; p++)
+      count[*p >> shift & 0xff]++;
+    unsigned* next[256]; // Of every bucket, to place.
+    unsigned* end[256];
+    unsigned* pos = first;
+    for (int b = 0; b < 256; b++) {
+      next[b] = pos;
+      pos += count[b];
+      end[b] = pos;
+    }
+    for (int b = 0; b < 256; b++)
+      while (next[b] != end[b]) { // Cycles of the permutation into buckets.
+        unsigned x = *next[b];
+        for (int d = x >> shift & 0xff; d != b; d = x >> shift & 0xff)
+          std::swap(x, *next[d]++);
+        *next[b]++ = x;
+      }
+    if (shift == 0)
+      return;
+    for (int b = 0; b < 256; b++)
+      if (count[b] > 1)
+        sort(end[b] - count[b], end[b], shift - 8);
+  }
+};
+
+// Plain reads from element 'first' by the calling thread, over stdio buffers; same interface as FileReadBuf.
+template<class T>
+class FileRead
+{
+public:
+
+  FileRead(const std::string& name, size_t = 0, size_t first = 0) : file(name, "rb"s)
+  {
+    if (first && file)
+      file.seek(first * sizeof(T));
+  }
+
+  bool read(T& x) { return file.read(x) == 1; }
+
+private:
+
+  File file;
+};
+
+// Reads of merge inputs: double buffered by a loader thread per input.
+struct BufferedReads
+{
+  static const char* name() { return "buffered"; }
+  template<class Rec> using Reader = FileReadBuf<Rec>;
+};
+
+// Reads of merge inputs: by the merging thread.
+struct DirectReads
+{
+  static const char* name() { return "direct"; }
+  template<class Rec> using Reader = FileRead<Rec>;
+};
+
+struct SortOptions;
+class Manifest;
+enum class Aggregate;
+struct RunRange;
+
+// Sort engine: a combination of policies with its hot paths, run generation and merge, instantiated for it.
+// Name is "threads-kernel-reads", e.g. "pool-std-buffered", which is the default one.
+struct Engine
+{
+  std::string name;
+  bool threaded; // See PoolThreads.
+  // Sort records [first, last) of input into pieces "0", "1"... Returns their number.
+  int (*createPieces)(const std::string& input, size_t memSize, int numThreads, const SortOptions& opt, Manifest* manifest,
+    size_t first, size_t last);
+  // See mergeRuns.
+  uint64_t (*mergeRuns)(const std::string& output, const std::vector<RunRange>& inputs, Aggregate agg,
+    long long at, uint64_t* checksum, const IndexOptions& index);
+};
+
+// All combinations of policies, the default engine is the first one.
+const std::vector<Engine>& engines();
+
+// Engine for all sorts of the process from now on. False if there is no such one.
+bool selectEngine(const std::string& name);
+
+const Engine& currentEngine();
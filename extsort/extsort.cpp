@@ -3,76 +3,243 @@
 #include "file.hpp"
 #include "merge.hpp"
 #include "timer.hpp"
+#include "affinity.hpp"
+#include "metrics.hpp"
+#include "manifest.hpp"
+#include "job_dir.hpp"
+#include "engine.hpp"
 #include <vector>
 #include <algorithm>
 #include <numeric>
 #include <cmath>
 #include <iostream>
-
-#define USE_THREADS 1
+#include <memory>
+#include <stdexcept>
+#include <fstream>
+#include <thread>
+#include <climits>
+#include <cstdlib>
+#include <atomic>
 
 typedef unsigned Data;
 typedef std::vector<NoInit<Data>> Buffer;
 struct Chunk
 {
   int uid;
+  Aggregate agg;
+  Manifest* manifest;
   Buffer buf;
 };
 
+// Write sorted buf as KeyCount records, over a small buffer. Returns number of records.
+static size_t writeCounted(File& f, const Buffer& buf, uint64_t& hash)
+{
+  std::vector<KeyCount> out;
+  out.reserve(std::min(buf.size(), size_t(64 * 1024)));
+  size_t written = 0;
+  for (size_t i = 0; i < buf.size(); ) {
+    size_t j = i + 1;
+    while (j < buf.size() && buf[j] == buf[i])
+      j++;
+    out.emplace_back();
+    out.back().key = buf[i];
+    out.back().setCount(j - i);
+    if (out.size() == out.capacity()) {
+      hash = checksum(out.data(), out.size() * sizeof(KeyCount), hash);
+      written += f.write(out);
+      out.clear();
+    }
+    i = j;
+  }
+  hash = checksum(out.data(), out.size() * sizeof(KeyCount), hash);
+  return written + f.write(out);
+}
+
+template<class Kernel>
 static void sortOnePiece(Chunk& chunk)
 {
-  std::sort(chunk.buf.begin(), chunk.buf.end());
-  File f(std::to_string(chunk.uid), "wb"s);
-  f.write(chunk.buf);
+  Metrics::get().nameThread("sort worker");
+  {
+    Span span("sort", chunk.uid);
+    span.addBytes(chunk.buf.size() * sizeof(Data));
+    auto first = reinterpret_cast<Data*>(chunk.buf.data());
+    Kernel::sort(first, first + chunk.buf.size());
+    if (chunk.agg == Aggregate::unique)
+      chunk.buf.erase(std::unique(chunk.buf.begin(), chunk.buf.end()), chunk.buf.end());
+  }
+  Span span("write", chunk.uid);
+  const auto name = std::to_string(chunk.uid);
+  File f(name, "wb"s);
+  uint64_t hash = checksum(nullptr, 0);
+  size_t records = 0;
+  if (chunk.agg == Aggregate::count) {
+    records = writeCounted(f, chunk.buf, hash);
+    span.addBytes(records * sizeof(KeyCount));
+  }
+  else {
+    records = f.write(chunk.buf);
+    span.addBytes(records * sizeof(Data));
+    if (chunk.manifest)
+      hash = checksum(chunk.buf.data(), records * sizeof(Data), hash);
+  }
+  f.close();
+  if (chunk.manifest) {
+    syncFile(name);
+    chunk.manifest->addRun(name, records, hash);
+  }
 }
 
-static int createSortedPieces(
+// Allocate the buffer and write a word per page from the calling thread,
+//   so the OS places the pages on its NUMA node. The buffer is reused for next chunks.
+static void firstTouch(Buffer& buf, size_t bufSize)
+{
+  buf.resize(bufSize);
+  for (size_t i = 0; i < bufSize; i += 4096 / sizeof(Data))
+    buf[i] = 0;
+}
+
+// Cpus of the NUMA node of the device keeping intermediate files, all cpus if unknown.
+static std::vector<int> mergeCpus()
+{
+  auto& topo = CpuTopology::get();
+  auto node = deviceNode(".");
+  auto cpus = node < 0 ? std::vector<int>() : topo.nodeCpus(node);
+  return cpus.empty() ? topo.cpus() : cpus;
+}
+
+// Sort records [first, last) of input into pieces "0", "1"... Returns their number.
+template<class Threads, class Kernel>
+static int createSortedPiecesWith(
   const std::string& input,
   size_t memSize,
-  int numThreads
+  int numThreads,
+  const SortOptions& opt,
+  Manifest* manifest,
+  size_t first,
+  size_t last
 )
 {
+  if (!Threads::threaded)
+    numThreads = 1; // One piece in memory at a time, as large as memory allows.
   Timer timer;
+  Phase phase("run generation");
   File f(input, "rb"s);
-  size_t fileSize = f.size(); // Bytes.
-  size_t pieces = size_t(std::ceil(double(fileSize) / (memSize / numThreads)));
-  size_t bufSize = (fileSize / sizeof(Data)) / pieces + 1; // Numbers.
-  std::cout << "file size = " << fileSize << "(" << double(fileSize) / (1024.0 * 1024.0) << "M),";
+  const size_t inputSize = f.size();
+  const bool stream = inputSize == SIZE_MAX; // A pipe: pieces are as large as memory allows, until its end.
+  const size_t begin = stream ? 0 : std::min(first, inputSize / sizeof(Data)) * sizeof(Data);
+  size_t fileSize = stream ? SIZE_MAX : std::min(last, inputSize / sizeof(Data)) * sizeof(Data) - begin; // Bytes.
+  if (begin)
+    f.seek(begin);
+  size_t pieces = stream ? 0 : std::max(size_t(1), size_t(std::ceil(double(fileSize) / (memSize / numThreads))));
+  size_t bufSize = stream ? std::max(size_t(1), memSize / numThreads / sizeof(Data)) : (fileSize / sizeof(Data)) / pieces + 1; // Numbers.
+  if (stream)
+    std::cout << "file size = unknown,";
+  else
+    std::cout << "file size = " << fileSize << "(" << double(fileSize) / (1024.0 * 1024.0) << "M),";
   std::cout << " mem size = " << memSize << "(" << double(memSize) / (1024.0 * 1024.0) << "M),";
   std::cout << " buf size = " << bufSize << ",";
-  std::cout << " pieces = " << double(fileSize) / (bufSize * sizeof(Data)) << "\n";
-#ifdef USE_THREADS
-  ThreadPool<Chunk, decltype(sortOnePiece)> pool(numThreads, sortOnePiece);
-#endif
+  if (!stream)
+    std::cout << " pieces = " << double(fileSize) / (bufSize * sizeof(Data));
+  std::cout << "\n";
+  std::function<void(int, Chunk&)> init;
+  if (opt.pinThreads) {
+    auto cpus = CpuTopology::get().spreadOrder();
+    std::cout << "Pin sort workers over " << CpuTopology::get().numNodes() << " NUMA node(s)\n";
+    init = [cpus, bufSize](int t, Chunk& chunk) {
+      pinThread({ cpus[t % cpus.size()] });
+      firstTouch(chunk.buf, bufSize);
+    };
+  }
+  typename Threads::template Pool<Chunk, decltype(sortOnePiece<Kernel>)> pool(numThreads, sortOnePiece<Kernel>, init);
   int uid = 0;
+  int skipped = 0;
   for (; uid * bufSize * sizeof(Data) < fileSize; uid++) {
-#ifdef USE_THREADS
+    if (manifest && manifest->resuming()) {
+      if (manifest->isDone(std::to_string(uid))) {
+        skipped++;
+        continue;
+      }
+      f.seek(begin + uid * bufSize * sizeof(Data));
+    }
     auto& t = pool.waitFree();
     auto& chunk = t.setup();
     chunk.uid = uid;
-#else
-    Chunk chunk;
-#endif
-    chunk.buf.resize(bufSize);
-    auto loadedSize = f.read(chunk.buf);
-    chunk.buf.resize(loadedSize);
-#ifdef USE_THREADS
+    chunk.agg = opt.agg;
+    chunk.manifest = manifest;
+    size_t loadedSize = 0;
+    {
+      Span span("read", uid, input);
+      chunk.buf.resize(std::min(bufSize, fileSize / sizeof(Data) - uid * bufSize));
+      loadedSize = f.read(chunk.buf);
+      chunk.buf.resize(loadedSize);
+      span.addBytes(loadedSize * sizeof(Data));
+    }
+    Metrics::get().addRun(loadedSize);
     t.start();
-#else
-    sortOnePiece(chunk);
-#endif
     if (loadedSize < bufSize) {
       uid++;
       break;
     }
   }
-#ifdef USE_THREADS
+  if (skipped)
+    std::cout << "Resume: " << skipped << " sorted pieces are done\n";
   pool.terminate();
   std::cout << "Partial sort: " << timer << "sec. Main thread pool waits: " << pool.mainWaits() << "\n";
-#endif
   return uid;
 }
 
+template<class Threads, class Kernel, class Reads>
+static Engine makeEngine()
+{
+  return Engine{ std::string(Threads::name()) + "-" + Kernel::name() + "-" + Reads::name(), Threads::threaded,
+    createSortedPiecesWith<Threads, Kernel>, mergeRunsWith<Threads, Reads> };
+}
+
+const std::vector<Engine>& engines()
+{
+  static const std::vector<Engine> all = {
+    makeEngine<PoolThreads, StdSort, BufferedReads>(),
+    makeEngine<PoolThreads, StdSort, DirectReads>(),
+    makeEngine<PoolThreads, RadixSort, BufferedReads>(),
+    makeEngine<PoolThreads, RadixSort, DirectReads>(),
+    makeEngine<SingleThread, StdSort, BufferedReads>(),
+    makeEngine<SingleThread, StdSort, DirectReads>(),
+    makeEngine<SingleThread, RadixSort, BufferedReads>(),
+    makeEngine<SingleThread, RadixSort, DirectReads>()
+  };
+  return all;
+}
+
+static const Engine* selectedEngine = nullptr;
+
+bool selectEngine(const std::string& name)
+{
+  for (auto& engine : engines())
+    if (engine.name == name) {
+      selectedEngine = &engine;
+      return true;
+    }
+  return false;
+}
+
+const Engine& currentEngine()
+{
+  return selectedEngine ? *selectedEngine : engines().front();
+}
+
+static int createSortedPieces(
+  const std::string& input,
+  size_t memSize,
+  int numThreads,
+  const SortOptions& opt,
+  Manifest* manifest,
+  size_t first = 0,
+  size_t last = SIZE_MAX
+)
+{
+  return currentEngine().createPieces(input, memSize, numThreads, opt, manifest, first, last);
+}
+
 static void straightMergeFiles(
   const std::string& output, 
   int n
@@ -93,29 +260,219 @@ static void straightMergeFiles(
   }
 }
 
-#ifdef USE_THREADS
+// Merge pool threads cannot throw, so check inputs of merges to redo in advance.
+static void checkResumable(Manifest& manifest, const std::string& output, const std::vector<int>& ids)
+{
+  if (manifest.isDone(output))
+    return;
+  for (auto id : ids)
+    if (!manifest.isDone(std::to_string(id)))
+      throw std::runtime_error("Cannot resume: run " + std::to_string(id) + " is lost or broken.");
+}
+
+// First record of a sorted file.
+template<class Rec>
+static bool readFirst(const std::string& name, Rec& x)
+{
+  File f(name, "rb"s);
+  return f && f.read(x) == 1;
+}
+
+// Index of the first record not less than x in a sorted file of n records.
+template<class Rec>
+static size_t lowerBound(File& f, size_t n, const Rec& x)
+{
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    Rec y;
+    f.seek(mid * sizeof(Rec));
+    if (f.read(y) == 1 && y < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void setKey(Data& x, unsigned key) { x = key; }
+static void setKey(KeyCount& x, unsigned key) { x = KeyCount{ key, 0, 0 }; }
+
+// Keys sampled evenly from sorted runs, from each one in proportion to its size.
+template<class Rec>
+static std::vector<unsigned> sampleRuns(const std::vector<std::string>& names, size_t numSamples)
+{
+  std::vector<size_t> sizes;
+  size_t total = 0;
+  for (auto& name : names) {
+    sizes.push_back(File(name, "rb"s).size() / sizeof(Rec));
+    total += sizes.back();
+  }
+  std::vector<unsigned> samples;
+  for (size_t r = 0; r < names.size(); r++) {
+    File f(names[r], "rb"s);
+    const size_t n = std::min(sizes[r], std::max(size_t(1), size_t(double(numSamples) * sizes[r] / std::max(total, size_t(1)))));
+    for (size_t j = 0; j < n; j++) {
+      Rec x;
+      if (f.seek((j * sizes[r] + sizes[r] / 2) / n * sizeof(Rec)) && f.read(x) == 1)
+        samples.push_back(keyOf(x));
+    }
+  }
+  return samples;
+}
+
+// Quantiles of samples: shard p of nShards starts at key splitters[p - 1].
+static std::vector<unsigned> chooseSplitters(std::vector<unsigned> samples, int nShards)
+{
+  std::sort(samples.begin(), samples.end());
+  std::vector<unsigned> splitters;
+  for (int p = 1; p < nShards; p++)
+    splitters.push_back(samples.empty() ? 0 : samples[samples.size() * p / nShards]);
+  return splitters;
+}
+
+// Merge sorted runs into outputs by key ranges of splitters, concurrently; a run is split by binary search.
+// Returns records of every output. If checksums are asked, outputs are synced too.
+template<class Rec>
+static std::vector<uint64_t> mergeSplit(const std::vector<std::string>& names, const std::vector<unsigned>& splitters,
+  const std::vector<std::string>& outputs, Aggregate agg, const IndexOptions& index, std::vector<uint64_t>* checksums)
+{
+  std::vector<std::vector<size_t>> bounds(names.size()); // Per run: first record of every output and the end.
+  {
+    Span span("split");
+    for (size_t r = 0; r < names.size(); r++) {
+      File f(names[r], "rb"s);
+      const size_t n = f ? f.size() / sizeof(Rec) : 0;
+      bounds[r].push_back(0);
+      for (auto key : splitters) {
+        Rec x;
+        setKey(x, key);
+        bounds[r].push_back(std::max(bounds[r].back(), lowerBound(f, n, x)));
+      }
+      bounds[r].push_back(n);
+    }
+  }
+  std::vector<uint64_t> records(outputs.size());
+  if (checksums)
+    checksums->resize(outputs.size());
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < outputs.size(); p++)
+    threads.emplace_back([&, p]() {
+      Metrics::get().nameThread("merge");
+      std::vector<RunRange> runs;
+      for (size_t r = 0; r < names.size(); r++)
+        if (bounds[r][p] < bounds[r][p + 1])
+          runs.push_back(RunRange{ names[r], bounds[r][p], bounds[r][p + 1] });
+      records[p] = mergeRuns(outputs[p], runs, agg, -1, checksums ? &(*checksums)[p] : nullptr, index);
+      if (checksums) {
+        syncFile(outputs[p]);
+        if (index.every)
+          syncFile(indexName(outputs[p]));
+      }
+    });
+  for (auto& t : threads)
+    t.join();
+  return records;
+}
+
+// Boundaries: first and last key of the range of every shard, inclusive; the last is less than the first for an empty range.
+static void writeShardBounds(const std::string& output, const std::vector<unsigned>& splitters, const std::vector<uint64_t>& records,
+  bool sync)
+{
+  const int nShards = int(records.size());
+  std::ofstream f(shardsName(output));
+  f << "extsort-shards 1\n" << "shards " << nShards << "\n";
+  for (int p = 0; p < nShards; p++)
+    f << "shard " << p << " " << (p == 0 ? 0 : splitters[p - 1]) << " "
+      << (p + 1 == nShards ? int64_t(UINT_MAX) : int64_t(splitters[p]) - 1) << " " << records[p] << " " << shardName(output, p) << "\n";
+  f.close();
+  if (!f || (sync && !syncFile(shardsName(output))))
+    throw std::runtime_error("Cannot write " + shardsName(output));
+  std::cout << "Shards: " << nShards << "\n";
+}
+
+// Records of the last merge pass go to opt.shards outputs of balanced non-overlapping key ranges, merged concurrently.
+// Splitters are quantiles of keys sampled from the inputs.
+// In the manifest, shards are runs and the last one is the output of the merge, logged after all others and the boundaries.
+template<class Rec>
+static void mergeShards(const std::string& output, const std::vector<int>& ids, const SortOptions& opt, Manifest* manifest)
+{
+  std::vector<std::string> names;
+  for (auto id : ids)
+    names.push_back(std::to_string(id));
+  std::vector<std::string> outputs;
+  for (int p = 0; p < opt.shards; p++)
+    outputs.push_back(shardName(output, p));
+  if (manifest && manifest->resuming()) {
+    bool done = File(shardsName(output), "rb"s);
+    for (auto& name : outputs)
+      done = done && manifest->isDone(name);
+    if (done) {
+      for (auto& name : names)
+        std::remove(name.data()); // Leftovers of the crash.
+      return;
+    }
+    checkResumable(*manifest, outputs.back(), ids);
+  }
+  auto splitters = chooseSplitters(sampleRuns<Rec>(names, 64 * size_t(opt.shards)), opt.shards);
+  std::vector<uint64_t> checksums;
+  auto records = mergeSplit<Rec>(names, splitters, outputs, opt.agg, opt.index, manifest ? &checksums : nullptr);
+  writeShardBounds(output, splitters, records, manifest != nullptr);
+  if (manifest) {
+    for (int p = 0; p + 1 < opt.shards; p++)
+      manifest->addRun(outputs[p], records[p], checksums[p]);
+    manifest->addMerge(outputs.back(), records.back(), checksums.back(), ids); // NB: before inputs are removed.
+  }
+  for (auto& name : names)
+    std::remove(name.data());
+}
+
+// The last merge pass, into output or its shards.
+static void lastMerge(const std::string& output, const std::vector<int>& ids, const SortOptions& opt, Manifest* manifest)
+{
+  if (opt.shards < 2)
+    mergeFiles(output, ids, opt.agg, manifest, opt.index);
+  else if (opt.agg == Aggregate::count)
+    mergeShards<KeyCount>(output, ids, opt, manifest);
+  else
+    mergeShards<Data>(output, ids, opt, manifest);
+}
+
 void externalMergePar(
   const std::string& output,
   int nFiles,
-  int numThreads
+  int numThreads,
+  const SortOptions& opt,
+  Manifest* manifest
 )
 {
   Timer timerp;
+  Phase phase("merge phase");
   int nSlotsPerThread = std::max(2, int(double(nFiles) / numThreads + 0.5));
-  std::vector<std::vector<int>> ids; // Split all input file ids for numThreads.
+  std::vector<MergeTask> ids; // Split all input file ids for numThreads.
   std::vector<int> idsLast; // Ids for last pass.
   for (int i = 0; i < nFiles;) {
     int n = nSlotsPerThread;
     if (ids.size() + 1 == numThreads || nFiles - i < n + 2)
       n = nFiles - i;
-    ids.emplace_back(n); // Last one for output file.
-    std::iota(ids.back().begin(), ids.back().end(), i);
+    ids.emplace_back();
+    ids.back().ids.resize(n); // Last one for output file.
+    ids.back().agg = opt.agg;
+    ids.back().manifest = manifest;
+    std::iota(ids.back().ids.begin(), ids.back().ids.end(), i);
     idsLast.push_back(nFiles + int(idsLast.size()));
-    ids.back().push_back(idsLast.back());
+    ids.back().ids.push_back(idsLast.back());
     i += n;
   }
   std::cout << "Merge threads: " << ids.size() << "\n";
-  ThreadPool<std::vector<int>, decltype(mergeFiles1)> pool(int(ids.size()), mergeFiles1);
+  if (manifest && manifest->resuming())
+    for (auto& task : ids)
+      checkResumable(*manifest, std::to_string(task.ids.back()), std::vector<int>(task.ids.begin(), task.ids.end() - 1));
+  std::vector<int> cpus = opt.pinThreads ? mergeCpus() : std::vector<int>();
+  std::function<void(int, MergeTask&)> init;
+  if (!cpus.empty())
+    init = [cpus](int, MergeTask&) { pinThread(cpus); }; // Its read/write buffer threads inherit it.
+  ThreadPool<MergeTask, decltype(mergeFiles1)> pool(int(ids.size()), mergeFiles1, init);
   for (auto& ids1 : ids) {
     auto& t = pool.waitFree();
     t.setup() = ids1;
@@ -124,18 +481,22 @@ void externalMergePar(
   pool.terminate();
   std::cout << "Parallel passes of externalMergePar: " << timerp << "sec.\n";
   Timer timer;
-  mergeFiles(output, idsLast);
+  ScopedPin pin(cpus);
+  lastMerge(output, idsLast, opt, manifest);
   std::cout << "Last pass of externalMergePar: " << timer << "sec.\n";
   std::cout << "Intermediate files: " << idsLast.back() + 1 << "\n";
 }
-#endif
 
 void externalMerge(
   const std::string& output,
   int nFiles,
-  int numSlots
+  int numSlots,
+  const SortOptions& opt,
+  Manifest* manifest
 )
 {
+  ScopedPin pin(opt.pinThreads ? mergeCpus() : std::vector<int>());
+  Phase phase("merge phase");
   if (numSlots == 0)
     numSlots = nFiles;
   std::cout << "Merge slots: " << numSlots << "\n";
@@ -145,22 +506,103 @@ void externalMerge(
     std::vector<int> ids2(ids.begin(), ids.begin() + numSlots);
     ids.erase(ids.begin(), ids.begin() + numSlots);
     ids.push_back(nFiles++);
-    mergeFiles(std::to_string(ids.back()), ids2);
+    mergeFiles(std::to_string(ids.back()), ids2, opt.agg, manifest);
   }
-  mergeFiles(output, ids);
+  lastMerge(output, ids, opt, manifest);
   std::cout << "Intermediate files: " << nFiles << "\n";
 }
 
+// Start or continue the log of the job, none if it is not asked.
+static std::unique_ptr<Manifest> openManifest(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  const std::string& mode,
+  int modeArg,
+  const SortOptions& opt
+)
+{
+  if (opt.manifest.empty())
+    return nullptr;
+  Manifest::Params params;
+  params.input = input;
+  params.output = output;
+  params.inputSize = File(input, "rb"s).size();
+  params.memSize = memSize;
+  params.numThreads = numThreads;
+  params.mode = mode;
+  params.modeArg = modeArg;
+  params.agg = opt.agg;
+  params.shards = opt.shards;
+  params.index = opt.index;
+  std::unique_ptr<Manifest> manifest(new Manifest());
+  if (!opt.resume) {
+    if (!manifest->create(opt.manifest, params))
+      throw std::runtime_error("Cannot create manifest " + opt.manifest);
+    return manifest;
+  }
+  if (!manifest->load(opt.manifest))
+    throw std::runtime_error("Cannot load manifest " + opt.manifest);
+  auto& p = manifest->params();
+  if (p.input != input || p.output != output || p.inputSize != params.inputSize || p.memSize != memSize ||
+    p.numThreads != numThreads || p.mode != mode || p.modeArg != modeArg || p.agg != opt.agg || p.shards != opt.shards ||
+    p.index.every != opt.index.every || p.index.bloomBits != opt.index.bloomBits)
+    throw std::runtime_error("Manifest " + opt.manifest + " is for another job or input was changed");
+  return manifest;
+}
+
+// An index of previous output would not match the new one.
+static void removeStaleIndex(const std::string& output, const SortOptions& opt)
+{
+  if (!opt.index.every)
+    std::remove(indexName(output).data());
+}
+
+// Shards listed in output.shards with their indexes, and the list.
+static void removeShards(const std::string& output)
+{
+  std::ifstream f(shardsName(output));
+  std::string header, word;
+  int nShards = 0;
+  if (std::getline(f, header) && f >> word >> nShards && word == "shards")
+    for (int p = 0; p < nShards; p++) {
+      std::remove(shardName(output, p).data());
+      std::remove(indexName(shardName(output, p)).data());
+    }
+  f.close();
+  std::remove(shardsName(output).data());
+}
+
+// Files of the other layout of output, see SortOptions::shards, would be read along with the new ones.
+// Old shards go too, there may be more of them. When resuming, all files are of the job.
+static void removeOtherLayout(const std::string& output, const SortOptions& opt)
+{
+  if (opt.resume)
+    return;
+  removeShards(output);
+  if (opt.shards >= 2) {
+    std::remove(output.data());
+    std::remove(indexName(output).data());
+  }
+}
+
 void externalSort(
   const std::string& input,
   const std::string& output,
   size_t memSize,
   int numThreads,
-  int numSlots
+  int numSlots,
+  const SortOptions& opt
 )
 {
-  auto nFiles = createSortedPieces(input, memSize, numThreads);
-  externalMerge(output, nFiles, numSlots);
+  auto manifest = openManifest(input, output, memSize, numThreads, "slots", numSlots, opt);
+  removeStaleIndex(output, opt);
+  removeOtherLayout(output, opt);
+  auto nFiles = createSortedPieces(input, memSize, numThreads, opt, manifest.get());
+  externalMerge(output, nFiles, numSlots, opt, manifest.get());
+  if (manifest)
+    manifest->remove();
 }
 
 void externalSortNPasses(
@@ -168,19 +610,354 @@ void externalSortNPasses(
   const std::string& output,
   size_t memSize,
   int numThreads,
-  int numPasses
+  int numPasses,
+  const SortOptions& opt
 )
 {
-  auto nFiles = createSortedPieces(input, memSize, numThreads);
-#ifdef USE_THREADS
-  if (numPasses == 0 && nFiles > 3) {
-    externalMergePar(output, nFiles, numThreads);
+  auto manifest = openManifest(input, output, memSize, numThreads, "passes", numPasses, opt);
+  removeStaleIndex(output, opt);
+  removeOtherLayout(output, opt);
+  auto nFiles = createSortedPieces(input, memSize, numThreads, opt, manifest.get());
+  if (currentEngine().threaded && numPasses == 0 && nFiles > 3)
+    externalMergePar(output, nFiles, numThreads, opt, manifest.get());
+  else if (numPasses <= 1 || numPasses >= nFiles)
+    externalMerge(output, nFiles, 0, opt, manifest.get());
+  else
+    externalMerge(output, nFiles, nFiles / numPasses + 1, opt, manifest.get());
+  if (manifest)
+    manifest->remove();
+}
+
+// Copy records [first, n) of a file into a new one.
+template<class Rec>
+static void copyTail(File& f, size_t first, size_t n, const std::string& output)
+{
+  File o(output, "wb"s);
+  std::vector<NoInit<Rec>> buf;
+  f.seek(first * sizeof(Rec));
+  for (size_t pos = first; pos < n; pos += buf.size()) {
+    buf.resize(std::min(n - pos, size_t(1024 * 1024)));
+    buf.resize(f.read(buf));
+    if (buf.empty())
+      break;
+    if (o.write(buf) != buf.size())
+      throw std::runtime_error("Cannot write " + output);
+  }
+}
+
+// Merge the first runs into a new one in groups of maxMergeRuns until at most 'limit' runs are left,
+//   so a merge has few open files. Returns ids of the runs left.
+static std::vector<int> mergeGroups(std::vector<int> ids, size_t limit, Aggregate agg)
+{
+  for (int next = ids.empty() ? 0 : ids.back() + 1; ids.size() > limit; next++) {
+    std::vector<int> ids2(ids.begin(), ids.begin() + std::min(ids.size(), size_t(maxMergeRuns)));
+    ids.erase(ids.begin(), ids.begin() + ids2.size());
+    ids.push_back(next);
+    mergeFiles(std::to_string(next), ids2, agg);
+  }
+  return ids;
+}
+
+// Journal of an in-place delta merge: where the tail of base starts and which runs replace it.
+// It is synced with the runs before base is changed, so an interrupted rewrite is redone from them, see mergeDelta.
+static std::string deltaJournalName(const std::string& base) { return base + ".delta"; }
+
+static void writeDeltaJournal(const std::string& base, size_t first, const std::vector<int>& ids, Aggregate agg)
+{
+  const auto name = deltaJournalName(base);
+  std::ofstream f(name);
+  f << "extsort-delta 1\n" << first << " " << int(agg) << " " << ids.size();
+  for (auto id : ids)
+    f << " " << id;
+  f << "\n";
+  f.close();
+  if (!f || !syncFile(name))
+    throw std::runtime_error("Cannot write " + name);
+}
+
+// False if there is no complete journal, then base was not changed.
+static bool readDeltaJournal(const std::string& base, size_t& first, std::vector<int>& ids, Aggregate& agg)
+{
+  std::ifstream f(deltaJournalName(base));
+  std::string header;
+  int a = 0;
+  size_t n = 0;
+  if (!std::getline(f, header) || header != "extsort-delta 1" || !(f >> first >> a >> n))
+    return false;
+  ids.resize(n);
+  for (auto& id : ids)
+    f >> id;
+  if (!f)
+    return false;
+  agg = Aggregate(a);
+  return true;
+}
+
+// Merge runs into base from record 'first' on and cut the rest of the old tail, then drop the journal and the runs.
+// Redone as a whole after a crash, the result is the same.
+template<class Rec>
+static void rewriteTail(const std::string& base, size_t first, const std::vector<int>& ids, Aggregate agg)
+{
+  std::vector<std::string> inputs;
+  for (auto id : ids)
+    inputs.push_back(std::to_string(id));
+  const size_t n = File(base, "rb"s).size() / sizeof(Rec);
+  auto records = mergeNamedFiles(base, inputs, agg, (long long)(first * sizeof(Rec)));
+  if (first + records < n && !truncateFile(base, (first + records) * sizeof(Rec))) // Collapsed equal keys.
+    throw std::runtime_error("Cannot truncate " + base);
+  if (!syncFile(base))
+    throw std::runtime_error("Cannot sync " + base);
+  std::remove(deltaJournalName(base).data()); // NB: before runs are removed.
+  for (auto& name : inputs)
+    std::remove(name.data());
+}
+
+// Merge sorted runs of delta into base, see mergeDelta. There are less than maxMergeRuns of them.
+template<class Rec>
+static void mergeDeltaRuns(const std::string& base, const std::string& output, std::vector<int> ids, Aggregate agg)
+{
+  std::vector<std::string> runs;
+  for (auto id : ids)
+    runs.push_back(std::to_string(id));
+  File f(base, "rb"s);
+  if (!f || output != base) {
+    auto inputs = runs;
+    if (f)
+      inputs.push_back(base);
+    else
+      std::cout << "Delta: no " << base << ", the delta is the whole output\n";
+    f.close();
+    mergeNamedFiles(output, inputs, agg);
+    for (auto& name : runs)
+      std::remove(name.data());
     return;
   }
-#endif
-  if (numPasses == 1 || numPasses >= nFiles)
-    externalMerge(output, nFiles, 0);
+  // Base records less than all of delta stay where they are, like in LSM-tree compaction.
+  Rec deltaMin{};
+  bool hasDelta = false;
+  for (auto& name : runs) {
+    Rec x;
+    if (readFirst(name, x) && (!hasDelta || x < deltaMin)) {
+      deltaMin = x;
+      hasDelta = true;
+    }
+  }
+  const size_t n = f.size() / sizeof(Rec);
+  const size_t first = hasDelta ? lowerBound(f, n, deltaMin) : n;
+  if (first < n) {
+    ids.push_back(ids.empty() ? 0 : ids.back() + 1); // Tail of base is just another run.
+    runs.push_back(std::to_string(ids.back()));
+    copyTail<Rec>(f, first, n, runs.back());
+  }
+  f.close();
+  std::cout << "Delta: keep " << first << " of " << n << " records of base, " << (first == n ? "append" : "rewrite the tail") << "\n";
+  for (auto& name : runs)
+    if (!syncFile(name))
+      throw std::runtime_error("Cannot sync " + name);
+  writeDeltaJournal(base, first, ids, agg);
+  rewriteTail<Rec>(base, first, ids, agg);
+}
+
+void mergeDelta(
+  const std::string& base,
+  const std::string& delta,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  const SortOptions& opt
+)
+{
+  size_t first = 0;
+  std::vector<int> ids;
+  Aggregate agg = opt.agg;
+  if (output == base && readDeltaJournal(base, first, ids, agg)) {
+    if (agg != opt.agg)
+      throw std::runtime_error("Interrupted merge of a delta into " + base + " has other sort options");
+    std::cout << "Finish the interrupted merge of a delta into " << base << ", " << delta << " is not merged again\n";
+    Timer timer;
+    Phase phase("merge phase");
+    if (opt.agg == Aggregate::count)
+      rewriteTail<KeyCount>(base, first, ids, opt.agg);
+    else
+      rewriteTail<Data>(base, first, ids, opt.agg);
+    std::cout << "Merge delta: " << timer << "sec.\n";
+  }
+  else {
+    std::remove(deltaJournalName(base).data()); // Torn before base was changed.
+    ids.resize(createSortedPieces(delta, memSize, numThreads, opt, nullptr));
+    std::iota(ids.begin(), ids.end(), 0);
+    Timer timer;
+    Phase phase("merge phase");
+    ids = mergeGroups(ids, maxMergeRuns - 1, opt.agg); // And base or its tail.
+    if (opt.agg == Aggregate::count)
+      mergeDeltaRuns<KeyCount>(base, output, ids, opt.agg);
+    else
+      mergeDeltaRuns<Data>(base, output, ids, opt.agg);
+    std::cout << "Merge delta: " << timer << "sec.\n";
+  }
+  removeStaleIndex(output, opt);
+  removeShards(output);
+  if (opt.index.every)
+    indexFile(output, opt.index, opt.agg == Aggregate::count ? sizeof(KeyCount) : sizeof(Data)); // Offsets of the tail moved.
+}
+
+// Second half of a worker, see sortWorker.
+template<class Rec>
+static void workerShards(const JobDir& job, const std::string& output, const std::vector<int>& ids, int worker, int numWorkers,
+  const SortOptions& opt)
+{
+  std::vector<std::string> names;
+  for (auto id : ids)
+    names.push_back(std::to_string(id));
+  if (!job.publish(job.samples(worker), sampleRuns<Rec>(names, 64 * size_t(numWorkers))))
+    throw std::runtime_error("Cannot write " + job.samples(worker));
+  auto splitters = job.receive<unsigned>(job.splitters());
+  std::vector<std::string> parts;
+  for (int p = 0; p < numWorkers; p++)
+    parts.push_back(job.part(worker, p));
+  mergeSplit<Rec>(names, splitters, parts, opt.agg, IndexOptions(), nullptr);
+  for (auto& name : names)
+    std::remove(name.data());
+  job.publish(job.partsDone(worker), std::vector<unsigned>());
+
+  std::vector<std::string> mine; // Parts of all workers for the shard of this one.
+  for (int w = 0; w < numWorkers; w++) {
+    job.receive<unsigned>(job.partsDone(w));
+    mine.push_back(job.part(w, worker));
+  }
+  auto records = mergeNamedFiles(shardName(output, worker), mine, opt.agg, -1, nullptr, opt.index);
+  for (auto& name : mine)
+    std::remove(name.data());
+  job.publish(job.shardDone(worker), std::vector<uint64_t>{ records });
+}
+
+void sortWorker(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  int worker,
+  int numWorkers,
+  const std::string& dir,
+  const SortOptions& opt
+)
+{
+  Timer timer;
+  const JobDir job(absolutePath(dir));
+  const auto in = absolutePath(input);
+  const auto out = absolutePath(output);
+  const auto home = currentDir();
+  if (!makeDir(job.name()) || !makeDir(job.workerDir(worker)) || !changeDir(job.workerDir(worker)))
+    throw std::runtime_error("Cannot work in " + job.workerDir(worker));
+  int nRuns = 0;
+  try {
+    File f(in, "rb"s);
+    if (!f)
+      throw std::runtime_error("Cannot open " + in);
+    const size_t n = f.size() / sizeof(Data);
+    f.close();
+    nRuns = createSortedPieces(in, memSize, numThreads, opt, nullptr,
+      n * worker / numWorkers, n * (worker + 1) / numWorkers);
+    Phase phase("merge phase");
+    // Few runs to split, so parts are merged with few open files.
+    std::vector<int> ids(nRuns);
+    std::iota(ids.begin(), ids.end(), 0);
+    ids = mergeGroups(ids, maxMergeRuns, opt.agg);
+    if (opt.agg == Aggregate::count)
+      workerShards<KeyCount>(job, out, ids, worker, numWorkers, opt);
+    else
+      workerShards<Data>(job, out, ids, worker, numWorkers, opt);
+  }
+  catch (...) {
+    job.setAbort();
+    for (int id = 0; id < 2 * nRuns; id++) // Pieces and the runs merged of them.
+      std::remove(std::to_string(id).data());
+    for (int p = 0; p < numWorkers; p++)
+      std::remove(job.part(worker, p).data());
+    changeDir(home);
+    removeDir(job.workerDir(worker));
+    throw;
+  }
+  changeDir(home);
+  removeDir(job.workerDir(worker));
+  std::cout << "Worker " << worker << " of " << numWorkers << ": " << timer << "sec.\n";
+}
+
+void sortCoordinator(
+  const std::string& output,
+  int numWorkers,
+  const std::string& dir,
+  const std::string& workerCommand
+)
+{
+  if (!makeDir(dir))
+    throw std::runtime_error("Cannot create " + dir);
+  const JobDir job(dir);
+  std::vector<std::thread> workers;
+  if (!workerCommand.empty()) {
+    job.clear(numWorkers); // NB: workers started apart may have published already.
+    for (int w = 0; w < numWorkers; w++)
+      workers.emplace_back([&job, &workerCommand, w]() {
+        if (std::system((workerCommand + " -worker " + std::to_string(w)).data()) != 0)
+          job.setAbort();
+      });
+  }
+  try {
+    std::vector<unsigned> samples;
+    for (int w = 0; w < numWorkers; w++) {
+      auto s = job.receive<unsigned>(job.samples(w));
+      samples.insert(samples.end(), s.begin(), s.end());
+    }
+    auto splitters = chooseSplitters(samples, numWorkers);
+    SortOptions layout;
+    layout.shards = numWorkers;
+    removeOtherLayout(output, layout); // NB: before workers write shards.
+    if (!job.publish(job.splitters(), splitters))
+      throw std::runtime_error("Cannot write " + job.splitters());
+    std::vector<uint64_t> records;
+    for (int w = 0; w < numWorkers; w++) {
+      auto r = job.receive<uint64_t>(job.shardDone(w));
+      records.push_back(r.empty() ? 0 : r[0]);
+    }
+    writeShardBounds(output, splitters, records, false);
+  }
+  catch (...) {
+    job.setAbort();
+    for (auto& t : workers)
+      t.join();
+    if (!workers.empty()) { // All are done, workers started apart may still have to see the abort.
+      job.clear(numWorkers);
+      removeDir(dir);
+    }
+    throw;
+  }
+  for (auto& t : workers)
+    t.join();
+  job.clear(numWorkers);
+  removeDir(dir); // If nothing else is there.
+}
+
+bool resumeExternalSort(SortOptions& opt)
+{
+  Manifest manifest;
+  if (!manifest.load(opt.manifest)) {
+    std::cerr << "No job to resume in " << opt.manifest << "\n";
+    return false;
+  }
+  auto& p = manifest.params();
+  // Outputs of the job are made with its own options, other ones would be mixed with them.
+  if ((opt.shards && opt.shards != p.shards) || (opt.index.every && opt.index.every != p.index.every)) {
+    std::cerr << "Options differ from the job in " << opt.manifest << ": -shards " << p.shards << ", -index " << p.index.every << "\n";
+    return false;
+  }
+  opt.agg = p.agg;
+  opt.shards = p.shards;
+  opt.index = p.index;
+  opt.resume = true;
+  std::cout << "Resume sort of " << p.input << " into " << p.output << "\n";
+  if (p.mode == "slots")
+    externalSort(p.input, p.output, p.memSize, p.numThreads, p.modeArg, opt);
   else
-    externalMerge(output, nFiles, nFiles / numPasses + 1);
-  
+    externalSortNPasses(p.input, p.output, p.memSize, p.numThreads, p.modeArg, opt);
+  return true;
 }
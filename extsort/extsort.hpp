@@ -1,12 +1,29 @@
 #pragma once
+#include "merge.hpp"
 #include <string>
 
+// Knobs of the sort engine apart from the memory/threads/passes ones.
+struct SortOptions
+{
+  bool pinThreads = false; // Pin sort workers over NUMA nodes with node-local chunks, merge near the device.
+  Aggregate agg = Aggregate::none; // Collapse equal keys in sorted pieces and in every merge pass.
+  std::string manifest; // Durable log of the job to resume it after a crash, none if empty.
+  bool resume = false; // Skip runs and merges done according to the manifest.
+  IndexOptions index; // Sparse index of the output written by the last merge pass, a stale one is removed.
+  int shards = 0; // Range partitioned outputs of the last merge pass with their boundaries, one output if less than 2.
+};
+
+// Files of the range partitioned output, see SortOptions::shards.
+inline std::string shardName(const std::string& output, int shard) { return output + "." + std::to_string(shard); }
+inline std::string shardsName(const std::string& output) { return output + ".shards"; }
+
 void externalSort(
   const std::string& input,
   const std::string& output,
   size_t memSize,
   int numThreads,
-  int slots
+  int slots,
+  const SortOptions& opt = SortOptions()
 );
 
 void externalSortNPasses(
@@ -14,5 +31,48 @@ void externalSortNPasses(
   const std::string& output,
   size_t memSize,
   int numThreads,
-  int numPasses
+  int numPasses,
+  const SortOptions& opt = SortOptions()
 );
+
+// Sort delta into runs and merge them with sorted base in one streaming pass; without base, delta is sorted into output.
+// If output is base, it is updated in place: records of base less than all of delta are kept,
+//   only the tail is rewritten; delta not less than all of base is just appended.
+// The rewrite is journaled, if it was interrupted by a crash the next call finishes it and does not read delta.
+// Base must be sorted with the same opt.agg.
+void mergeDelta(
+  const std::string& base,
+  const std::string& delta,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  const SortOptions& opt = SortOptions()
+);
+
+// Multi-process sort over a directory shared by all processes, see JobDir; processes may run on different hosts.
+// Worker i sorts slice i of input and writes shard i of output, see shardName.
+// It throws std::runtime_error if the job is aborted by another process.
+void sortWorker(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  int worker,
+  int numWorkers,
+  const std::string& dir,
+  const SortOptions& opt = SortOptions()
+);
+
+// Coordinator chooses global splitters from samples of workers and writes boundaries of shards, see shardsName.
+// It runs workerCommand + " -worker i" for every worker as local processes, unless the command is empty;
+//   then the dir must have no leftovers of a failed job.
+void sortCoordinator(
+  const std::string& output,
+  int numWorkers,
+  const std::string& dir,
+  const std::string& workerCommand
+);
+
+// Continue the job logged in opt.manifest with its own parameters, opt.agg is set to the job's one.
+// Sort functions throw std::runtime_error if the job cannot be resumed.
+bool resumeExternalSort(SortOptions& opt);
@@ -1,5 +1,6 @@
 #pragma once
 #include "timer.hpp"
+#include "metrics.hpp"
 #include <cstdio>
 #include <string>
 using namespace std::string_literals;
@@ -8,15 +9,25 @@ using namespace std::string_literals;
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <cstdint>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
+// Name "-" is stdin for reading or stdout for writing, it is flushed but not closed.
 class File
 {
   FILE* fp = nullptr;
+  bool isStd = false;
 public:
   File() = default;
   File(const std::string& name, const std::string& mode)
   {
-    fp = std::fopen(name.data(), mode.data());
+    open(name, mode);
   }
   ~File()
   {
@@ -34,18 +45,38 @@ public:
   }
   bool open(const std::string& name, const std::string& mode)
   {
-    fp = std::fopen(name.data(), mode.data());
+    isStd = name == "-";
+    if (!isStd)
+      fp = std::fopen(name.data(), mode.data());
+    else {
+      fp = mode[0] == 'r' ? stdin : stdout;
+#if defined(_WIN32)
+      _setmode(_fileno(fp), _O_BINARY);
+#endif
+    }
     return *this;
   }
   void close()
   {
-    if (fp)
+    if (fp && isStd)
+      std::fflush(fp);
+    else if (fp)
       std::fclose(fp);
     fp = nullptr;
   }
-  size_t size()
+  bool seek(size_t pos)
+  {
+#if defined(_WIN32)
+    return _fseeki64(fp, pos, SEEK_SET) == 0;
+#else
+    return fseeko(fp, off_t(pos), SEEK_SET) == 0;
+#endif
+  }
+  size_t size() // SIZE_MAX if unknown, e.g. for a pipe.
   {
     auto pos = std::ftell(fp);
+    if (pos < 0)
+      return SIZE_MAX;
     std::fseek(fp, 0, SEEK_END);
     auto fileSize = std::ftell(fp);
     std::fseek(fp, pos, SEEK_SET);
@@ -78,6 +109,50 @@ public:
   }
 };
 
+// Order dependent checksum of 32bit words (FNV-1a over words), may be continued block by block.
+// All record types are made of 32bit words.
+inline uint64_t checksum(const void* p, size_t bytes, uint64_t h = 0xcbf29ce484222325ULL)
+{
+  auto* w = static_cast<const uint32_t*>(p);
+  for (size_t i = 0; i < bytes / sizeof(uint32_t); i++)
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// Flush the closed file to the device, so it survives a crash of the host.
+inline bool syncFile(const std::string& name)
+{
+#if defined(_WIN32)
+  int fd = _open(name.data(), _O_RDWR);
+  if (fd < 0)
+    return false;
+  bool ok = _commit(fd) == 0;
+  _close(fd);
+#else
+  int fd = ::open(name.data(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+#endif
+  return ok;
+}
+
+// Cut the closed file to 'size' bytes.
+inline bool truncateFile(const std::string& name, size_t size)
+{
+#if defined(_WIN32)
+  int fd = _open(name.data(), _O_RDWR);
+  if (fd < 0)
+    return false;
+  bool ok = _chsize_s(fd, size) == 0;
+  _close(fd);
+  return ok;
+#else
+  return ::truncate(name.data(), off_t(size)) == 0;
+#endif
+}
+
 // Helper for std::vector<NoInit<T>>
 template<class T>
 class NoInit {
@@ -98,16 +173,30 @@ class FileWriteBuf
 {
 public:
 
-  FileWriteBuf(const std::string& name, size_t sz = 256*1024) :
-    file(name, "wb"s),
-    t(&FileWriteBuf::run, this)
+  // Truncates the file, or writes over the existing one from byte 'at' if it is not negative.
+  // The checksum of written bytes is kept only if 'hashed'.
+  FileWriteBuf(const std::string& name, size_t sz = 256*1024, long long at = -1, bool hashed = false) :
+    file(name, at < 0 ? "wb"s : "r+b"s),
+    name(name),
+    hashed(hashed)
   {
+    if (at >= 0)
+      file.seek(size_t(at));
     buf.reserve(sz);
     bufWrite.reserve(sz);
+    t = std::thread(&FileWriteBuf::run, this); // NB: start it when all members are constructed.
   }
 
   ~FileWriteBuf()
   {
+    close();
+  }
+
+  // Flush all and close the file, then 'size' and 'checksum' are final.
+  void close()
+  {
+    if (!t.joinable())
+      return;
     {
       std::unique_lock<std::mutex> lock(m);
       cv.wait(lock, [this] { return ! doFlush; });
@@ -115,6 +204,7 @@ public:
     isTerminating = true;
     swap();
     t.join();
+    file.close();
   }
 
   void push_back(const T x)
@@ -140,17 +230,25 @@ public:
 
   auto mainWaits() const { return mainThreadWaits; }
 
+  size_t size() const { return written; } // Elements written so far.
+  uint64_t checksum() const { return hash; } // Of the bytes written so far if 'hashed', see 'checksum()'.
+
 private:
 
   void run()
   {
+    Metrics::get().nameThread("write buffer");
     while (true) {
       {
         std::unique_lock<std::mutex> lock(m);
         cv.wait(lock, [this] { return doFlush; });
       }
       if (bufWrite.size()) {
-        file.write(bufWrite);
+        Span span("write", -1, name);
+        if (hashed)
+          hash = ::checksum(bufWrite.data(), bufWrite.size() * sizeof(T), hash);
+        written += file.write(bufWrite);
+        span.addBytes(bufWrite.size() * sizeof(T));
         bufWrite.clear();
       }
       {
@@ -174,6 +272,8 @@ private:
   }
 
   File file;
+  std::string name;
+  bool hashed;
 
   std::thread t;
   std::mutex m;
@@ -182,6 +282,8 @@ private:
   bool isTerminating = false;
   size_t maxCapacity = 0;
   double mainThreadWaits = 0.0;
+  size_t written = 0;
+  uint64_t hash = ::checksum(nullptr, 0);
 
   std::vector<NoInit<T>> buf; // Collect by push_back.
   std::vector<NoInit<T>> bufWrite; // Write it to file.
@@ -194,13 +296,18 @@ class FileReadBuf
 {
 public:
 
-  FileReadBuf(const std::string& name, size_t sz = 256 * 1024) :
+  // Read from element 'first'.
+  FileReadBuf(const std::string& name, size_t sz = 256 * 1024, size_t first = 0) :
     file(name, "rb"s),
-    t(&FileReadBuf::run, this),
+    name(name),
     isEOF(false)
   {
     buf.reserve(sz);
     buf2.reserve(sz);
+    fileSize = file ? file.size() : 0; // NB: cannot seek later, while the loader reads.
+    if (first && file)
+      file.seek(first * sizeof(T));
+    t = std::thread(&FileReadBuf::run, this); // NB: start it when all members are constructed.
     setLoad(true);
   }
 
@@ -216,7 +323,7 @@ public:
     t.join();
   }
 
-  size_t size() { return file.size(); }
+  size_t size() const { return fileSize; }
 
   bool read(T& x)
   {
@@ -224,6 +331,7 @@ public:
       if (isEOF)
         return false;
       Timer timer;
+      Span span("wait", -1, name);
       std::unique_lock<std::mutex> lock(m);
       cv.wait(lock, [this] { return !doLoad; });
       //lock.unlock();
@@ -259,6 +367,7 @@ private:
   }
   void run()
   {
+    Metrics::get().nameThread("read buffer");
     while (true)
     {
       std::unique_lock<std::mutex> lock(m);
@@ -266,8 +375,10 @@ private:
       if (isEOF)
         break;
       lock.unlock();
+      Span span("read", -1, name);
       buf2.resize(buf2.capacity());
       buf2.resize(file.read(buf2));
+      span.addBytes(buf2.size() * sizeof(T));
       if (buf2.size() == 0)
         isEOF = true;
       setLoad(false);
@@ -275,6 +386,8 @@ private:
   }
 
   File file;
+  std::string name;
+  size_t fileSize = 0;
 
   std::thread t;
   std::mutex m;
@@ -0,0 +1,218 @@
+#include "index.hpp"
+#include "file.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <climits>
+
+struct IndexHeader
+{
+  char magic[8];
+  uint32_t recSize;
+  uint32_t bloomHashes;
+  uint64_t every;
+  uint64_t records;
+  uint64_t blocks;
+  uint64_t bloomWords;
+};
+
+static const char indexMagic[8] = { 'e', 'x', 't', 'i', 'd', 'x', '1', 0 };
+
+// Splitmix64 finalizer, two halves of it make hashes of the bloom filter.
+static uint64_t mixKey(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+SparseIndex::SparseIndex(const IndexOptions& opt, size_t recSize, uint64_t maxKeys)
+  : recSize(recSize), every(std::max(size_t(1), opt.every))
+{
+  blocks.reserve(size_t(maxKeys / every + 1));
+  if (opt.bloomBits > 0) {
+    bloom.resize(size_t((maxKeys * opt.bloomBits + 63) / 64 + 1));
+    bloomHashes = std::max(1, std::min(16, int(std::lround(opt.bloomBits * 0.69))));
+  }
+}
+
+void SparseIndex::addToBloom(unsigned key)
+{
+  const uint64_t h = mixKey(key);
+  const uint64_t bits = bloom.size() * 64;
+  uint64_t a = h & 0xffffffff, b = (h >> 32) | 1;
+  for (int i = 0; i < bloomHashes; i++, a += b) {
+    const uint64_t bit = a % bits;
+    bloom[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+bool SparseIndex::mayContain(unsigned key) const
+{
+  if (bloom.empty())
+    return true;
+  const uint64_t h = mixKey(key);
+  const uint64_t bits = bloom.size() * 64;
+  uint64_t a = h & 0xffffffff, b = (h >> 32) | 1;
+  for (int i = 0; i < bloomHashes; i++, a += b) {
+    const uint64_t bit = a % bits;
+    if (!(bloom[bit / 64] & (1ULL << (bit % 64))))
+      return false;
+  }
+  return true;
+}
+
+size_t SparseIndex::firstBlockNotBelow(unsigned key) const
+{
+  return std::lower_bound(blocks.begin(), blocks.end(), key,
+    [](const Block& b, unsigned k) { return b.last < k; }) - blocks.begin();
+}
+
+size_t SparseIndex::firstBlockAbove(unsigned key) const
+{
+  return std::upper_bound(blocks.begin(), blocks.end(), key,
+    [](unsigned k, const Block& b) { return k < b.last; }) - blocks.begin();
+}
+
+bool SparseIndex::save(const std::string& name) const
+{
+  Span span("index", -1, name);
+  IndexHeader h;
+  std::memcpy(h.magic, indexMagic, sizeof(h.magic));
+  h.recSize = uint32_t(recSize);
+  h.bloomHashes = uint32_t(bloomHashes);
+  h.every = every;
+  h.records = records;
+  h.blocks = blocks.size();
+  h.bloomWords = bloom.size();
+  File f(name, "wb"s);
+  if (!f)
+    return false;
+  bool ok = f.write(&h, 1) == 1 && f.write(blocks) == blocks.size() && f.write(bloom) == bloom.size();
+  span.addBytes(sizeof(h) + blocks.size() * sizeof(Block) + bloom.size() * sizeof(uint64_t));
+  Metrics::get().count("index_blocks", blocks.size());
+  return ok && std::fflush(f) == 0;
+}
+
+bool SparseIndex::load(const std::string& name)
+{
+  File f(name, "rb"s);
+  IndexHeader h;
+  if (!f || f.read(h) != 1 || std::memcmp(h.magic, indexMagic, sizeof(h.magic)) || h.recSize == 0 || h.every == 0)
+    return false;
+  recSize = h.recSize;
+  bloomHashes = int(h.bloomHashes);
+  every = h.every;
+  records = h.records;
+  blocks.resize(size_t(h.blocks));
+  bloom.resize(size_t(h.bloomWords));
+  return f.read(blocks) == blocks.size() && f.read(bloom) == bloom.size();
+}
+
+bool indexFile(const std::string& file, const IndexOptions& opt, size_t recSize)
+{
+  File f(file, "rb"s);
+  if (!f)
+    return false;
+  const uint64_t n = f.size() / recSize;
+  SparseIndex index(opt, recSize, n);
+  const size_t stride = recSize / sizeof(unsigned);
+  std::vector<NoInit<unsigned>> buf;
+  for (uint64_t pos = 0; pos < n; ) {
+    buf.resize(size_t(std::min(n - pos, uint64_t(1024 * 1024))) * stride);
+    if (f.read(buf) != buf.size())
+      return false;
+    for (size_t i = 0; i < buf.size(); i += stride)
+      index.add(buf[i]);
+    pos += buf.size() / stride;
+  }
+  return index.save(indexName(file));
+}
+
+// One block of a file in memory, as 32bit words; records are 'stride' words, the key first.
+struct BlockReader
+{
+  File& f;
+  const SparseIndex& index;
+  size_t stride;
+  size_t loaded = SIZE_MAX;
+  std::vector<NoInit<unsigned>> words;
+  int reads = 0;
+
+  BlockReader(File& f, const SparseIndex& index) : f(f), index(index), stride(index.recordSize() / sizeof(unsigned)) {}
+
+  bool load(size_t b)
+  {
+    if (b == loaded)
+      return true;
+    auto& blocks = index.allBlocks();
+    const uint64_t end = b + 1 < blocks.size() ? blocks[b + 1].offset : index.size() * index.recordSize();
+    words.resize(size_t(end - blocks[b].offset) / sizeof(unsigned));
+    reads++;
+    if (!f.seek(size_t(blocks[b].offset)) || f.read(words) != words.size())
+      return false;
+    loaded = b;
+    return true;
+  }
+
+  size_t records() const { return words.size() / stride; }
+  unsigned key(size_t i) const { return words[i * stride]; }
+  uint64_t count(size_t i) const { return stride < 3 ? 1 : uint64_t(words[i * stride + 2]) << 32 | words[i * stride + 1]; }
+
+  // Index of the first record in the file with a key not less than (above = false) or greater than x.
+  bool bound(unsigned x, bool above, uint64_t& pos)
+  {
+    auto& blocks = index.allBlocks();
+    const size_t b = above ? index.firstBlockAbove(x) : index.firstBlockNotBelow(x);
+    if (b == blocks.size()) {
+      pos = index.size();
+      return true;
+    }
+    pos = blocks[b].offset / index.recordSize();
+    if (above ? blocks[b].first > x : blocks[b].first >= x)
+      return true; // The block starts with it, no need to read.
+    if (!load(b))
+      return false;
+    size_t lo = 0, hi = records();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (above ? key(mid) <= x : key(mid) < x)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    pos += lo;
+    return true;
+  }
+};
+
+bool lookupRange(const std::string& file, unsigned lo, unsigned hi, LookupResult& res)
+{
+  res = LookupResult();
+  SparseIndex index;
+  File f(file, "rb"s);
+  if (!index.load(indexName(file)) || !f)
+    return false;
+  if (lo > hi)
+    return true;
+  if (lo == hi && !index.mayContain(lo)) {
+    res.bloomSkipped = true;
+    return true;
+  }
+  BlockReader reader(f, index);
+  uint64_t end = 0;
+  if (!reader.bound(lo, false, res.first) || !reader.bound(hi, true, end))
+    return false;
+  res.records = end - res.first;
+  res.count = res.records;
+  if (lo == hi && res.records == 1 && reader.stride > 1) {
+    const size_t b = size_t(res.first / index.blockSize()); // Usually loaded already.
+    if (!reader.load(b))
+      return false;
+    res.count = reader.count(size_t(res.first - index.allBlocks()[b].offset / index.recordSize()));
+  }
+  res.blockReads = reader.reads;
+  return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Sparse index of a sorted output, written by its last merge pass, none if 'every' is 0.
+struct IndexOptions
+{
+  size_t every = 0; // Records per block: first and last key and offset of every block are kept.
+  int bloomBits = 0; // Bits per key of the bloom filter, none if 0.
+};
+
+// Sidecar file of the index.
+inline std::string indexName(const std::string& file) { return file + ".idx"; }
+
+// Blocks of a sorted file of 32bit keys or KeyCount records, and an optional bloom filter of its keys.
+// File layout: Header, 'blocks' of Block, 'bloomWords' of 64bit words of the filter.
+class SparseIndex
+{
+public:
+
+  struct Block
+  {
+    uint64_t offset; // Bytes.
+    unsigned first;
+    unsigned last;
+  };
+
+  SparseIndex() = default;
+  SparseIndex(const IndexOptions& opt, size_t recSize, uint64_t maxKeys); // To build, maxKeys sizes the filter.
+
+  // Key of the next record of the file.
+  void add(unsigned key)
+  {
+    if (records % every == 0)
+      blocks.push_back(Block{ records * recSize, key, key });
+    blocks.back().last = key;
+    if (!bloom.empty() && (records % every == 0 || key != prevKey))
+      addToBloom(key);
+    prevKey = key;
+    records++;
+  }
+
+  bool save(const std::string& name) const;
+  bool load(const std::string& name);
+
+  size_t recordSize() const { return recSize; }
+  uint64_t size() const { return records; }
+  uint64_t blockSize() const { return every; }
+  const std::vector<Block>& allBlocks() const { return blocks; }
+
+  bool mayContain(unsigned key) const; // False if the key is surely not in the file.
+  size_t firstBlockNotBelow(unsigned key) const; // First block with the last key not less than key, or number of blocks.
+  size_t firstBlockAbove(unsigned key) const; // First block with the last key greater than key, or number of blocks.
+
+private:
+
+  void addToBloom(unsigned key);
+
+  size_t recSize = sizeof(unsigned);
+  uint64_t every = 1;
+  uint64_t records = 0;
+  unsigned prevKey = 0;
+  std::vector<Block> blocks;
+  int bloomHashes = 0;
+  std::vector<uint64_t> bloom;
+};
+
+// Build the index of an existing sorted file in one streaming pass.
+bool indexFile(const std::string& file, const IndexOptions& opt, size_t recSize);
+
+// Answer of a query, see lookupRange.
+struct LookupResult
+{
+  uint64_t first = 0; // Index of the first record with a key not less than lo.
+  uint64_t records = 0; // Records with keys in [lo, hi].
+  uint64_t count = 0; // Same as records, but the count of its KeyCount record for a point query.
+  int blockReads = 0;
+  bool bloomSkipped = false; // The filter said no, nothing was read.
+};
+
+// Find keys in [lo, hi] of a sorted file with its index: one block read for each bound.
+bool lookupRange(const std::string& file, unsigned lo, unsigned hi, LookupResult& res);
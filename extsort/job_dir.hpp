@@ -0,0 +1,130 @@
+#pragma once
+#include "file.hpp"
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <cerrno>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+inline bool makeDir(const std::string& name)
+{
+#if defined(_WIN32)
+  return _mkdir(name.data()) == 0 || errno == EEXIST;
+#else
+  return mkdir(name.data(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+inline bool removeDir(const std::string& name)
+{
+#if defined(_WIN32)
+  return _rmdir(name.data()) == 0;
+#else
+  return rmdir(name.data()) == 0;
+#endif
+}
+
+inline bool changeDir(const std::string& name)
+{
+#if defined(_WIN32)
+  return _chdir(name.data()) == 0;
+#else
+  return chdir(name.data()) == 0;
+#endif
+}
+
+inline std::string currentDir()
+{
+  char buf[4096];
+#if defined(_WIN32)
+  return _getcwd(buf, sizeof(buf)) ? buf : "";
+#else
+  return getcwd(buf, sizeof(buf)) ? buf : "";
+#endif
+}
+
+// Same file after the working dir is changed.
+inline std::string absolutePath(const std::string& name)
+{
+  const bool absolute = !name.empty() && (name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':'));
+  return absolute ? name : currentDir() + "/" + name;
+}
+
+// Files of a multi-process sort in a directory shared by the coordinator and its workers.
+// A data file appears at once, complete: it is written under a temporary name and renamed.
+// Protocol: every worker publishes samples of its slice; the coordinator publishes splitters;
+//   every worker writes its part for each shard, then merges parts of all workers for its own shard.
+class JobDir
+{
+public:
+
+  explicit JobDir(const std::string& dir) : dir(dir) {}
+
+  const std::string& name() const { return dir; }
+  std::string workerDir(int worker) const { return dir + "/worker." + std::to_string(worker); } // Its run files.
+  std::string samples(int worker) const { return dir + "/samples." + std::to_string(worker); }
+  std::string splitters() const { return dir + "/splitters"; }
+  std::string part(int worker, int shard) const { return dir + "/part." + std::to_string(worker) + "." + std::to_string(shard); }
+  std::string partsDone(int worker) const { return dir + "/parts." + std::to_string(worker); }
+  std::string shardDone(int shard) const { return dir + "/shard." + std::to_string(shard); } // Its number of records.
+  std::string abort() const { return dir + "/abort"; } // Some process failed, all others give up.
+
+  // Leftovers of a previous job.
+  void clear(int numWorkers) const
+  {
+    for (int i = 0; i < numWorkers; i++) {
+      std::remove(samples(i).data());
+      std::remove(partsDone(i).data());
+      std::remove(shardDone(i).data());
+    }
+    std::remove(splitters().data());
+    std::remove(abort().data());
+  }
+
+  template<class T>
+  bool publish(const std::string& name, const std::vector<T>& data) const
+  {
+    const auto tmp = name + ".tmp";
+    {
+      File f(tmp, "wb"s);
+      if (!f || f.write(data) != data.size())
+        return false;
+    }
+    std::remove(name.data()); // NB: rename does not replace on Windows.
+    return std::rename(tmp.data(), name.data()) == 0;
+  }
+
+  // Wait until the file is published and read it; throws std::runtime_error if the job is aborted.
+  template<class T>
+  std::vector<T> receive(const std::string& name) const
+  {
+    Span span("wait", -1, name);
+    while (!File(name, "rb"s)) {
+      if (File(abort(), "rb"s))
+        throw std::runtime_error("Job in " + dir + " is aborted");
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    File f(name, "rb"s);
+    std::vector<T> data(f.size() / sizeof(T));
+    data.resize(f.read(data));
+    return data;
+  }
+
+  void setAbort() const
+  {
+    File f(abort(), "wb"s);
+  }
+
+private:
+
+  std::string dir;
+};
@@ -0,0 +1,416 @@
+#include "lines.hpp"
+#include "thread_pool.hpp"
+#include "file.hpp"
+#include "timer.hpp"
+#include "metrics.hpp"
+#include "min_heap.hpp"
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <cstring>
+#include <climits>
+
+bool parseRecordFormat(const std::string& name, RecordFormat& format)
+{
+  if (name == "lines")
+    format = RecordFormat::lines;
+  else if (name == "sized")
+    format = RecordFormat::sized;
+  else
+    return false;
+  return true;
+}
+
+// First 8 bytes of a record as a big endian number padded with zeros, so prefixes compare as bytes do.
+static uint64_t keyPrefix(const char* p, uint32_t length)
+{
+  uint64_t x = 0;
+  const uint32_t n = std::min(length, uint32_t(8));
+  for (uint32_t i = 0; i < n; i++)
+    x |= uint64_t(uint8_t(p[i])) << (56 - 8 * i);
+  return x;
+}
+
+// Byte-wise order of records with equal prefixes: their first bytes are equal already.
+static bool lessBytes(const char* a, uint32_t la, const char* b, uint32_t lb)
+{
+  const uint32_t n = std::min(la, lb);
+  const uint32_t skip = std::min(n, uint32_t(8));
+  const int c = std::memcmp(a + skip, b + skip, n - skip);
+  return c < 0 || (c == 0 && la < lb);
+}
+
+static bool equalBytes(const char* a, uint32_t la, const char* b, uint32_t lb)
+{
+  return la == lb && std::memcmp(a, b, la) == 0;
+}
+
+// Complete record at the start of bytes [p, p + n): offset of its bytes from p, its length
+//   and bytes it takes with its delimiter or length. False if it is not complete.
+static bool findRecord(const char* p, size_t n, RecordFormat format, size_t& offset, uint32_t& length, size_t& size)
+{
+  if (format == RecordFormat::lines) {
+    auto eol = static_cast<const char*>(std::memchr(p, '\n', n));
+    if (!eol)
+      return false;
+    offset = 0;
+    length = uint32_t(eol - p);
+    size = size_t(length) + 1;
+    return true;
+  }
+  if (n < 4)
+    return false;
+  auto w = reinterpret_cast<const unsigned char*>(p);
+  offset = 4;
+  length = uint32_t(w[0]) | uint32_t(w[1]) << 8 | uint32_t(w[2]) << 16 | uint32_t(w[3]) << 24;
+  size = 4 + size_t(length);
+  return size <= n;
+}
+
+// Buffered output of records in their format.
+class RecordWriter
+{
+public:
+
+  RecordWriter(const std::string& name, RecordFormat format) : file(name, "wb"s), format(format)
+  {
+    ok = file;
+    buf.reserve(1024 * 1024);
+  }
+
+  void write(const char* p, uint32_t length)
+  {
+    if (format == RecordFormat::sized) {
+      const char w[4] = { char(length), char(length >> 8), char(length >> 16), char(length >> 24) };
+      append(w, 4);
+    }
+    append(p, length);
+    if (format == RecordFormat::lines)
+      append("\n", 1);
+    records++;
+  }
+
+  // False if anything failed.
+  bool close()
+  {
+    flush();
+    file.close();
+    return ok;
+  }
+
+  uint64_t size() const { return records; }
+  uint64_t bytes() const { return written; }
+
+private:
+
+  void append(const char* p, size_t n)
+  {
+    if (buf.size() + n > buf.capacity())
+      flush();
+    if (n > buf.capacity())
+      writeBytes(p, n);
+    else
+      buf.insert(buf.end(), p, p + n);
+  }
+
+  void flush()
+  {
+    writeBytes(buf.data(), buf.size());
+    buf.clear();
+  }
+
+  void writeBytes(const char* p, size_t n)
+  {
+    if (ok && n)
+      ok = file.write(p, n) == n;
+    written += n;
+  }
+
+  File file;
+  RecordFormat format;
+  bool ok = false;
+  uint64_t records = 0;
+  uint64_t written = 0;
+  std::vector<char> buf;
+};
+
+// Buffered input of records in their format. The current record stays valid until the next one is read.
+class RecordReader
+{
+public:
+
+  RecordReader(const std::string& name, RecordFormat format, size_t bufSize) :
+    file(name, "rb"s), name(name), format(format), buf(std::max(bufSize, size_t(4096)))
+  {
+    if (!file)
+      throw std::runtime_error("Cannot open " + name);
+  }
+
+  // Read the next record, false at the end.
+  bool next()
+  {
+    pos += size;
+    size_t offset = 0;
+    while (!findRecord(buf.data() + pos, end - pos, format, offset, len, size)) {
+      if (!fill()) {
+        if (pos == end)
+          return false;
+        if (format == RecordFormat::sized)
+          throw std::runtime_error("Broken record at the end of " + name);
+        offset = 0; // The last line has no '\n'.
+        len = uint32_t(end - pos);
+        size = len;
+        break;
+      }
+    }
+    ptr = buf.data() + pos + offset;
+    pre = keyPrefix(ptr, len);
+    return true;
+  }
+
+  const char* data() const { return ptr; }
+  uint32_t length() const { return len; }
+  uint64_t prefix() const { return pre; }
+
+private:
+
+  // Keep the incomplete record and read more after it. False at the end of the file.
+  bool fill()
+  {
+    if (eof)
+      return false;
+    std::memmove(buf.data(), buf.data() + pos, end - pos);
+    end -= pos;
+    pos = 0;
+    if (end == buf.size())
+      buf.resize(buf.size() * 2); // The record is longer than the buffer.
+    const size_t n = file.read(buf.data() + end, buf.size() - end);
+    end += n;
+    eof = n == 0;
+    return n > 0;
+  }
+
+  File file;
+  std::string name;
+  RecordFormat format;
+  std::vector<char> buf;
+  size_t pos = 0; // Current record with its delimiter or length.
+  size_t size = 0;
+  size_t end = 0; // Of bytes read.
+  bool eof = false;
+  const char* ptr = nullptr;
+  uint32_t len = 0;
+  uint64_t pre = 0;
+};
+
+// Record of a sorted piece: its prefix and where its bytes are in the buffer of the piece.
+struct RecordRef
+{
+  uint64_t prefix;
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct RecordChunk
+{
+  int uid;
+  RecordFormat format;
+  Aggregate agg;
+  std::atomic<bool>* failed;
+  std::vector<char> data; // Records as they are read, with their delimiters or lengths.
+  std::vector<RecordRef> recs;
+};
+
+static void sortRecordPiece(RecordChunk& chunk)
+{
+  Metrics::get().nameThread("sort worker");
+  const char* d = chunk.data.data();
+  {
+    Span span("sort", chunk.uid);
+    span.addBytes(chunk.data.size());
+    std::sort(chunk.recs.begin(), chunk.recs.end(), [d](const RecordRef& a, const RecordRef& b) {
+      return a.prefix < b.prefix || (a.prefix == b.prefix && lessBytes(d + a.offset, a.length, d + b.offset, b.length));
+    });
+    if (chunk.agg == Aggregate::unique)
+      chunk.recs.erase(std::unique(chunk.recs.begin(), chunk.recs.end(), [d](const RecordRef& a, const RecordRef& b) {
+        return a.prefix == b.prefix && equalBytes(d + a.offset, a.length, d + b.offset, b.length);
+      }), chunk.recs.end());
+  }
+  Span span("write", chunk.uid);
+  const auto name = std::to_string(chunk.uid);
+  RecordWriter out(name, chunk.format);
+  for (auto& r : chunk.recs)
+    out.write(d + r.offset, r.length);
+  if (!out.close()) {
+    std::cerr << "Cannot write " << name << "\n";
+    *chunk.failed = true;
+  }
+  span.addBytes(out.bytes());
+}
+
+// Sort input into pieces "0", "1"... of at most memSize / numThreads bytes with their refs. Returns their number.
+static int createRecordPieces(const std::string& input, size_t memSize, int numThreads, RecordFormat format, Aggregate agg)
+{
+  Timer timer;
+  Phase phase("run generation");
+  File f(input, "rb"s);
+  if (!f)
+    throw std::runtime_error("Cannot open " + input);
+  const size_t budget = std::min(std::max(memSize / numThreads, size_t(64 * 1024)), size_t(UINT32_MAX));
+  std::cout << "Variable length records: mem size = " << memSize << "(" << double(memSize) / (1024.0 * 1024.0) << "M),"
+    << " piece size = " << budget << "\n";
+  std::atomic<bool> failed(false);
+  ThreadPool<RecordChunk, decltype(sortRecordPiece)> pool(numThreads, sortRecordPiece);
+  std::vector<char> carry; // Incomplete record at the end of the previous piece.
+  bool eof = false;
+  int uid = 0;
+  uint64_t records = 0;
+  while (!eof || !carry.empty()) {
+    auto& t = pool.waitFree();
+    auto& chunk = t.setup();
+    chunk.uid = uid;
+    chunk.format = format;
+    chunk.agg = agg;
+    chunk.failed = &failed;
+    chunk.data.swap(carry);
+    carry.clear();
+    chunk.data.reserve(budget);
+    chunk.recs.clear();
+    size_t parsed = 0;
+    {
+      Span span("read", uid, input);
+      while (true) {
+        size_t offset = 0, size = 0;
+        uint32_t length = 0;
+        while (findRecord(chunk.data.data() + parsed, chunk.data.size() - parsed, format, offset, length, size)) {
+          chunk.recs.push_back(RecordRef{ keyPrefix(chunk.data.data() + parsed + offset, length), uint32_t(parsed + offset), length });
+          parsed += size;
+        }
+        if (eof || (!chunk.recs.empty() && chunk.data.size() + chunk.recs.size() * sizeof(RecordRef) >= budget))
+          break;
+        if (chunk.data.size() >= UINT32_MAX)
+          throw std::runtime_error("Record of " + input + " is too long");
+        const size_t old = chunk.data.size();
+        const size_t step = old < budget ? std::min(budget - old, size_t(1024 * 1024)) : size_t(1024 * 1024);
+        chunk.data.resize(old + step);
+        const size_t n = f.read(chunk.data.data() + old, step);
+        chunk.data.resize(old + n);
+        eof = n == 0;
+        span.addBytes(n);
+      }
+    }
+    if (parsed < chunk.data.size()) {
+      if (!eof)
+        carry.assign(chunk.data.begin() + parsed, chunk.data.end());
+      else if (format == RecordFormat::sized)
+        throw std::runtime_error("Broken record at the end of " + input);
+      else // The last line has no '\n'.
+        chunk.recs.push_back(RecordRef{ keyPrefix(chunk.data.data() + parsed, uint32_t(chunk.data.size() - parsed)),
+          uint32_t(parsed), uint32_t(chunk.data.size() - parsed) });
+    }
+    if (chunk.recs.empty())
+      break;
+    records += chunk.recs.size();
+    Metrics::get().addRun(chunk.recs.size());
+    t.start();
+    uid++;
+  }
+  pool.terminate();
+  if (failed)
+    throw std::runtime_error("Cannot write sorted pieces");
+  std::cout << "Records: " << records << ", pieces: " << uid << "\n";
+  std::cout << "Partial sort: " << timer << "sec. Main thread pool waits: " << pool.mainWaits() << "\n";
+  return uid;
+}
+
+// Current record of a merge input: prefixes are compared first, bytes only if they are equal.
+struct RecordKey
+{
+  uint64_t prefix;
+  const char* p;
+  uint32_t length;
+  bool operator<(const RecordKey& r) const { return prefix < r.prefix || (prefix == r.prefix && lessBytes(p, length, r.p, r.length)); }
+  bool operator==(const RecordKey& r) const { return prefix == r.prefix && equalBytes(p, length, r.p, r.length); }
+};
+
+static RecordKey keyOf(const RecordReader& in) { return RecordKey{ in.prefix(), in.data(), in.length() }; }
+
+// Merge sorted runs into output and remove them. Returns records written.
+static uint64_t mergeRecordRuns(const std::vector<std::string>& names, const std::string& output, size_t memSize,
+  RecordFormat format, Aggregate agg)
+{
+  Span span("merge", -1, output);
+  const size_t bufSize = std::max(size_t(64 * 1024), memSize / (names.size() + 1));
+  std::vector<std::unique_ptr<RecordReader>> ins;
+  for (auto& name : names) {
+    ins.emplace_back(new RecordReader(name, format, bufSize));
+    if (!ins.back()->next())
+      ins.pop_back(); // Empty run.
+  }
+  MinHeap<RecordKey> heap(int(ins.size()));
+  for (int i = 0; i < int(ins.size()); i++) {
+    heap[i].data = keyOf(*ins[i]);
+    heap[i].i = i;
+  }
+  heap.init();
+
+  RecordWriter out(output, format);
+  std::vector<char> last; // Written, for Aggregate::unique.
+  bool hasLast = false;
+  while (!heap.empty()) {
+    auto& top = heap[0];
+    auto& in = *ins[top.i];
+    if (agg != Aggregate::unique || !hasLast || !equalBytes(last.data(), uint32_t(last.size()), in.data(), in.length())) {
+      out.write(in.data(), in.length());
+      if (agg == Aggregate::unique) {
+        last.assign(in.data(), in.data() + in.length());
+        hasLast = true;
+      }
+    }
+    if (in.next()) {
+      top.data = keyOf(in);
+      heap.heapify(0);
+    }
+    else
+      heap.pop();
+  }
+  if (!out.close())
+    throw std::runtime_error("Cannot write " + output);
+  span.addBytes(out.bytes());
+  Metrics::get().count("heap_comparisons", heap.comparisons());
+  Metrics::get().count("merge_bytes", out.bytes());
+  ins.clear();
+  for (auto& name : names)
+    std::remove(name.data());
+  return out.size();
+}
+
+void sortRecords(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  RecordFormat format,
+  Aggregate agg
+)
+{
+  if (agg == Aggregate::count)
+    throw std::runtime_error("Variable length records cannot be counted");
+  const int nRuns = createRecordPieces(input, memSize, numThreads, format, agg);
+  Timer timer;
+  Phase phase("merge phase");
+  std::vector<std::string> names;
+  for (int i = 0; i < nRuns; i++)
+    names.push_back(std::to_string(i));
+  for (int next = nRuns; names.size() > maxMergeRuns; next++) {
+    std::vector<std::string> names2(names.begin(), names.begin() + maxMergeRuns);
+    names.erase(names.begin(), names.begin() + maxMergeRuns);
+    names.push_back(std::to_string(next));
+    mergeRecordRuns(names2, names.back(), memSize, format, agg);
+  }
+  const uint64_t records = mergeRecordRuns(names, output, memSize, format, agg);
+  std::cout << "Merge: " << records << " records, " << timer << "sec.\n";
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "merge.hpp"
+#include <string>
+
+// Variable length records, sorted byte-wise.
+enum class RecordFormat
+{
+  lines, // Text, every record ends with '\n', which is added to the last line if it is missing.
+  sized  // Binary, every record is its length as 32bit little endian word, then its bytes.
+};
+
+bool parseRecordFormat(const std::string& name, RecordFormat& format);
+
+// Sort variable length records like 'LC_ALL=C sort' does with lines, within memSize bytes.
+// A sorted piece is an array of (8 byte normalized key prefix, offset, length) over its records,
+//   sorted by prefixes; records are compared in full only if prefixes are equal. The merge compares prefixes first too.
+// Aggregate::unique keeps one of equal records, Aggregate::count is not supported.
+// Throws std::runtime_error if a file cannot be read or written or the input is broken.
+void sortRecords(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  RecordFormat format,
+  Aggregate agg = Aggregate::none
+);
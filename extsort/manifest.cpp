@@ -0,0 +1,179 @@
+#include "manifest.hpp"
+#include "file.hpp"
+#include <fstream>
+#include <sstream>
+
+static const char* const header = "extsort-manifest 1";
+
+bool Manifest::create(const std::string& name, const Params& params)
+{
+  m_name = name;
+  m_params = params;
+  m_resuming = false;
+  m_runs.clear();
+  m_consumedBy.clear();
+  {
+    File f(name, "wb"s); // Truncate, a new job.
+    if (!f)
+      return false;
+  }
+  std::stringstream ss;
+  ss << header << "\n"
+    << "input " << params.inputSize << " " << params.input << "\n"
+    << "output " << params.output << "\n"
+    << "mem " << params.memSize << "\n"
+    << "threads " << params.numThreads << "\n"
+    << "mode " << params.mode << " " << params.modeArg << "\n"
+    << "agg " << int(params.agg) << "\n"
+    << "shards " << params.shards << "\n"
+    << "index " << params.index.every << " " << params.index.bloomBits;
+  return append(ss.str());
+}
+
+bool Manifest::load(const std::string& name)
+{
+  std::ifstream f(name);
+  std::string line;
+  if (!std::getline(f, line) || line != header)
+    return false;
+  m_name = name;
+  m_params = Params();
+  m_runs.clear();
+  m_consumedBy.clear();
+  // Names of files are the rest of line, after all numbers.
+  auto rest = [](std::istream& ss) {
+    std::string s;
+    std::getline(ss >> std::ws, s);
+    return s;
+  };
+  while (std::getline(f, line)) {
+    if (f.eof())
+      break; // No line end, torn by a crash.
+    std::stringstream ss(line);
+    std::string kind;
+    ss >> kind;
+    if (kind == "input") {
+      ss >> m_params.inputSize;
+      m_params.input = rest(ss);
+    }
+    else if (kind == "output")
+      m_params.output = rest(ss);
+    else if (kind == "mem")
+      ss >> m_params.memSize;
+    else if (kind == "threads")
+      ss >> m_params.numThreads;
+    else if (kind == "mode")
+      ss >> m_params.mode >> m_params.modeArg;
+    else if (kind == "agg") {
+      int agg = 0;
+      ss >> agg;
+      m_params.agg = Aggregate(agg);
+    }
+    else if (kind == "shards")
+      ss >> m_params.shards;
+    else if (kind == "index")
+      ss >> m_params.index.every >> m_params.index.bloomBits;
+    else if (kind == "run" || kind == "merge") {
+      Run run;
+      ss >> run.records >> run.checksum;
+      std::vector<std::string> ids;
+      if (kind == "merge") {
+        size_t n = 0;
+        ss >> n;
+        ids.resize(n);
+        for (auto& id : ids)
+          ss >> id;
+      }
+      if (!ss)
+        continue;
+      auto file = rest(ss);
+      m_runs[file] = run;
+      for (auto& id : ids)
+        m_consumedBy[id] = file;
+    }
+  }
+  m_resuming = true;
+  return !m_params.input.empty() && !m_params.output.empty();
+}
+
+void Manifest::remove()
+{
+  if (!m_name.empty())
+    std::remove(m_name.data());
+}
+
+void Manifest::addRun(const std::string& file, uint64_t records, uint64_t checksum)
+{
+  std::lock_guard<std::mutex> lock(m);
+  m_runs[file] = Run{ records, checksum, 1 };
+  append("run " + std::to_string(records) + " " + std::to_string(checksum) + " " + file);
+}
+
+void Manifest::addMerge(const std::string& output, uint64_t records, uint64_t checksum, const std::vector<int>& ids)
+{
+  std::lock_guard<std::mutex> lock(m);
+  m_runs[output] = Run{ records, checksum, 1 };
+  std::string line = "merge " + std::to_string(records) + " " + std::to_string(checksum) + " " + std::to_string(ids.size());
+  for (auto id : ids) {
+    line += " " + std::to_string(id);
+    m_consumedBy[std::to_string(id)] = output;
+  }
+  append(line + " " + output);
+}
+
+bool Manifest::isDone(const std::string& file)
+{
+  std::unique_lock<std::mutex> lock(m);
+  auto consumed = m_consumedBy.find(file);
+  if (consumed != m_consumedBy.end()) {
+    auto output = consumed->second;
+    lock.unlock();
+    if (isDone(output))
+      return true; // Its file is just not removed yet, if any.
+    lock.lock();
+  }
+  auto itr = m_runs.find(file);
+  if (itr == m_runs.end())
+    return false;
+  if (!m_resuming || itr->second.state > 0)
+    return true;
+  if (itr->second.state == 0) {
+    auto run = itr->second;
+    lock.unlock(); // Do not block other merges while reading.
+    bool ok = verify(file, run);
+    lock.lock();
+    m_runs[file].state = ok ? 1 : -1;
+    return ok;
+  }
+  return false;
+}
+
+bool Manifest::append(const std::string& line)
+{
+  File f(m_name, "ab"s);
+  if (!f)
+    return false;
+  auto s = line + "\n";
+  bool ok = f.write(s.data(), s.size()) == s.size() && std::fflush(f) == 0;
+  f.close();
+  return syncFile(m_name) && ok;
+}
+
+bool Manifest::verify(const std::string& file, const Run& run) const
+{
+  File f(file, "rb"s);
+  if (!f)
+    return false;
+  const size_t recSize = m_params.agg == Aggregate::count ? sizeof(KeyCount) : sizeof(unsigned);
+  if (f.size() != run.records * recSize)
+    return false;
+  std::vector<uint32_t> buf(1024 * 1024);
+  uint64_t h = checksum(nullptr, 0);
+  while (true) {
+    auto n = f.read(buf);
+    if (n == 0)
+      break;
+    h = checksum(buf.data(), n * sizeof(uint32_t), h);
+  }
+  return h == run.checksum;
+}
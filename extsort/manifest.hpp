@@ -0,0 +1,63 @@
+#pragma once
+#include "merge.hpp"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+// Durable log of a sort job: its parameters, finished runs with checksums and finished merges.
+// Lines are appended and synced, so after a crash it keeps every completed step;
+//   a torn last line is ignored on load. Run files are synced before they are logged.
+class Manifest
+{
+public:
+
+  struct Params
+  {
+    std::string input;
+    std::string output;
+    size_t inputSize = 0;
+    size_t memSize = 0;
+    int numThreads = 0;
+    std::string mode; // "passes" or "slots", see externalSortNPasses and externalSort.
+    int modeArg = 0;
+    Aggregate agg = Aggregate::none;
+    int shards = 0; // See SortOptions.
+    IndexOptions index;
+  };
+
+  bool create(const std::string& name, const Params& params); // Start a new job.
+  bool load(const std::string& name); // Continue the logged job, see 'resuming'.
+  void remove(); // The job is complete.
+
+  const Params& params() const { return m_params; }
+  bool resuming() const { return m_resuming; }
+
+  // Thread safe. Output of a merge is also a run.
+  void addRun(const std::string& file, uint64_t records, uint64_t checksum);
+  void addMerge(const std::string& output, uint64_t records, uint64_t checksum, const std::vector<int>& ids);
+
+  // The run is logged and its file is intact, or it is consumed by a done merge.
+  // Checksums are verified once per file, when resuming.
+  bool isDone(const std::string& file);
+
+private:
+
+  struct Run
+  {
+    uint64_t records = 0;
+    uint64_t checksum = 0;
+    int state = 0; // 0 unknown, 1 intact, -1 broken.
+  };
+
+  bool append(const std::string& line);
+  bool verify(const std::string& file, const Run& run) const;
+
+  std::string m_name;
+  Params m_params;
+  bool m_resuming = false;
+  std::mutex m;
+  std::map<std::string, Run> m_runs;
+  std::map<std::string, std::string> m_consumedBy; // Input run to merge output.
+};
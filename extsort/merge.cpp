@@ -1,113 +1,232 @@
 #include "merge.hpp"
 #include "file.hpp"
+#include "metrics.hpp"
+#include "manifest.hpp"
+#include "engine.hpp"
+#include "min_heap.hpp"
+#include <stdexcept>
+#include <iostream>
 #include <vector>
+#include <algorithm>
 #include <climits>
 
-template<class Data>
-class MinHeap
-{
-  template<class Data1 = Data>
-  struct Node
-  {
-    Data1 data;
-    int i;
-    bool operator<(const Node& r) const
-    {
-      return data < r.data || data == r.data && i < r.i;
-    }
-  };
+typedef unsigned Data;
+
+template<class Rec>
+Rec maxRecord();
+
+template<>
+Data maxRecord<Data>() { return UINT_MAX; }
 
-  Node<Data>* pheap = nullptr;
-  int size = 0;
+template<>
+KeyCount maxRecord<KeyCount>() { return KeyCount{ UINT_MAX, 0, 0 }; }
 
+// Output of a merge pass which collapses equal records on the fly.
+template<class Rec, class Out>
+class Collapse
+{
 public:
 
-  MinHeap(int sz)
+  Collapse(Out& out) : out(out) {}
+
+  ~Collapse()
   {
-    pheap = new Node<Data>[sz];
-    size = sz;
+    if (hasPending)
+      out.push_back(pending);
   }
 
-  ~MinHeap()
+  void push_back(const Rec& x)
   {
-    delete pheap;
-    pheap = nullptr;
+    if (hasPending) {
+      if (pending == x) {
+        add(pending, x);
+        return;
+      }
+      out.push_back(pending);
+    }
+    pending = x;
+    hasPending = true;
   }
 
-  Node<Data>& operator[](int i) { return pheap[i]; }
+private:
+
+  void add(Data&, const Data&) {} // Aggregate::unique, drop it.
+  void add(KeyCount& acc, const KeyCount& x) { acc.setCount(acc.count() + x.count()); }
 
-  static int left(int i) { return 2 * i + 1; }
+  Out& out;
+  Rec pending;
+  bool hasPending = false;
+};
+
+// Output of the last merge pass which also builds the sparse index of the records written.
+template<class Rec, class Out>
+class Indexed
+{
+public:
 
-  static int right(int i) { return 2 * i + 2; }
+  Indexed(Out& out, SparseIndex& index) : out(out), index(index) {}
 
-  void init()
+  void push_back(const Rec& x)
   {
-    for (int i = (size - 1) / 2; i >= 0; i--)
-      heapify(i);
+    index.add(keyOf(x));
+    out.push_back(x);
   }
 
-  void heapify(const int i)
-  {
-    int smaller = i;
-    const int l = left(i);
-    if (l < size && pheap[l] < pheap[i])
-      smaller = l;
-    const int r = right(i);
-    if (r < size && pheap[r] < pheap[smaller])
-      smaller = r;
-    if (smaller != i) {
-      std::swap(pheap[i], pheap[smaller]);
-      heapify(smaller);
+private:
+
+  Out& out;
+  SparseIndex& index;
+};
+
+template<class Rec, class Reads, class Out>
+static uint64_t mergeRecords(Out& out, const std::vector<RunRange>& runs)
+{
+  const Rec maxData = maxRecord<Rec>();
+  std::vector<typename Reads::template Reader<Rec>> ins; // Input files, sorted pieces.
+  ins.reserve(runs.size());
+  std::vector<uint64_t> left; // Records to read of every run.
+  MinHeap<Rec> heap(int(runs.size()));
+  for (int i = 0; i < runs.size(); i++) {
+    ins.emplace_back(runs[i].name, 64 * 1024, size_t(runs[i].first));
+    left.push_back(runs[i].last - runs[i].first);
+    if (left.back() > 0 && ins.back().read(heap[i].data)) {
+      heap[i].i = i;
+      left.back()--;
+    }
+    else {
+      // Strange bad file with no elements.
+      heap[i].data = maxData;
+      heap[i].i = INT_MAX;
     }
   }
-};
+  heap.init();
 
-typedef unsigned Data;
-const Data maxData = UINT_MAX;
+  uint64_t nIn = 0;
+  for (int finished = 0; finished < runs.size(); ) {
+    auto& top = heap[0];
+    if (ins.size() <= top.i)
+      break;
+    out.push_back(top.data);
+    nIn++;
+    if (left[top.i] == 0 || !ins[top.i].read(top.data)) {
+      top.data = maxData;
+      top.i = INT_MAX;
+      finished++;
+    }
+    else
+      left[top.i]--;
+    heap.heapify(0);
+  }
+  Metrics::get().count("heap_comparisons", heap.comparisons());
+  return nIn;
+}
 
-#define BUFFERED_READ
+template<class Rec, class Reads, class Out>
+static void mergeCollapsed(Out& out, const std::vector<RunRange>& names, bool collapse)
+{
+  if (collapse) {
+    Collapse<Rec, Out> out1(out);
+    mergeRecords<Rec, Reads>(out1, names);
+  }
+  else
+    mergeRecords<Rec, Reads>(out, names);
+}
 
-void mergeFiles(const std::string& output, const std::vector<int>& ids)
+// Merge into a new file or at byte position 'at' of existing one, collapsing equal records if asked.
+// Returns records written and their checksum if 'hashed'.
+template<class Rec, class Threads, class Reads>
+static void mergeInto(const std::string& output, const std::vector<RunRange>& names, bool collapse, long long at,
+  const IndexOptions& index, bool hashed, uint64_t& records, uint64_t& hash)
 {
-  {
-#ifdef BUFFERED_READ
-    std::vector<FileReadBuf<Data>> ins; // Buffered input files, sorted pieces.
-#else
-    std::vector<File> ins; // Input files, sorted pieces.
-#endif
-    ins.reserve(ids.size());
-    MinHeap<Data> heap(int(ids.size()));
-    for (int i = 0; i < ids.size(); i++) {
-#ifdef BUFFERED_READ
-      ins.emplace_back(std::to_string(ids[i]), 64 * 1024);
-#else
-      ins.emplace_back(std::to_string(ids[i]), "rb"s);
-#endif
-      if (ins.back().read(heap[i].data))
-        heap[i].i = i;
-      else {
-        // Strange bad file with no elements.
-        heap[i].data = maxData;
-        heap[i].i = INT_MAX;
-      }
-    }
-    heap.init();
-
-    FileWriteBuf<Data> buf(output);
-
-    for (int finished = 0; finished < ids.size(); ) {
-      auto& top = heap[0];
-      if (ins.size() <= top.i)
-        break;
-      buf.push_back(top.data);
-      if (!ins[top.i].read(top.data)) {
-        top.data = maxData;
-        top.i = INT_MAX;
-        finished++;
-      }
-      heap.heapify(0);
+  using Writer = typename Threads::template Writer<Rec>;
+  Writer buf(output, 256 * 1024, at, hashed);
+  if (index.every) {
+    uint64_t maxKeys = 0;
+    for (auto& run : names)
+      maxKeys += std::min(run.last, uint64_t(File(run.name, "rb"s).size() / sizeof(Rec))) - run.first;
+    SparseIndex sparse(index, sizeof(Rec), maxKeys);
+    Indexed<Rec, Writer> out(buf, sparse);
+    mergeCollapsed<Rec, Reads>(out, names, collapse);
+    if (!sparse.save(indexName(output)))
+      std::cerr << "Cannot write index " << indexName(output) << "\n";
+  }
+  else
+    mergeCollapsed<Rec, Reads>(buf, names, collapse);
+  buf.close();
+  records = buf.size();
+  hash = buf.checksum();
+}
+
+template<class Threads, class Reads>
+uint64_t mergeRunsWith(const std::string& output, const std::vector<RunRange>& inputs, Aggregate agg,
+  long long at, uint64_t* checksum, const IndexOptions& index)
+{
+  uint64_t records = 0;
+  uint64_t hash = 0;
+  Span span("merge", -1, output);
+  if (agg == Aggregate::count)
+    mergeInto<KeyCount, Threads, Reads>(output, inputs, true, at, index, checksum != nullptr, records, hash);
+  else
+    mergeInto<Data, Threads, Reads>(output, inputs, agg == Aggregate::unique, at, index, checksum != nullptr, records, hash);
+  const uint64_t bytes = records * (agg == Aggregate::count ? sizeof(KeyCount) : sizeof(Data));
+  span.addBytes(bytes);
+  Metrics::get().count("merge_bytes", bytes);
+  if (checksum)
+    *checksum = hash;
+  return records;
+}
+
+template uint64_t mergeRunsWith<PoolThreads, BufferedReads>(const std::string&, const std::vector<RunRange>&, Aggregate, long long,
+  uint64_t*, const IndexOptions&);
+template uint64_t mergeRunsWith<PoolThreads, DirectReads>(const std::string&, const std::vector<RunRange>&, Aggregate, long long,
+  uint64_t*, const IndexOptions&);
+template uint64_t mergeRunsWith<SingleThread, BufferedReads>(const std::string&, const std::vector<RunRange>&, Aggregate, long long,
+  uint64_t*, const IndexOptions&);
+template uint64_t mergeRunsWith<SingleThread, DirectReads>(const std::string&, const std::vector<RunRange>&, Aggregate, long long,
+  uint64_t*, const IndexOptions&);
+
+uint64_t mergeRuns(const std::string& output, const std::vector<RunRange>& inputs, Aggregate agg,
+  long long at, uint64_t* checksum, const IndexOptions& index)
+{
+  return currentEngine().mergeRuns(output, inputs, agg, at, checksum, index);
+}
+
+uint64_t mergeNamedFiles(const std::string& output, const std::vector<std::string>& inputs, Aggregate agg,
+  long long at, uint64_t* checksum, const IndexOptions& index)
+{
+  std::vector<RunRange> runs(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++)
+    runs[i].name = inputs[i];
+  return mergeRuns(output, runs, agg, at, checksum, index);
+}
+
+void mergeFiles(const std::string& output, const std::vector<int>& ids, Aggregate agg, Manifest* manifest,
+  const IndexOptions& index)
+{
+  Metrics::get().nameThread("merge");
+  if (manifest && manifest->resuming()) {
+    if (manifest->isDone(output)) {
+      for (auto id : ids)
+        std::remove(std::to_string(id).data()); // Leftovers of the crash.
+      if (index.every && !File(indexName(output), "rb"s))
+        indexFile(output, index, agg == Aggregate::count ? sizeof(KeyCount) : sizeof(Data));
+      return;
     }
+    for (auto id : ids)
+      if (!manifest->isDone(std::to_string(id)))
+        throw std::runtime_error("Cannot resume: run " + std::to_string(id) + " is lost or broken.");
+  }
+  std::vector<std::string> names;
+  for (auto id : ids)
+    names.push_back(std::to_string(id));
+  uint64_t hash = 0;
+  const uint64_t records = mergeNamedFiles(output, names, agg, -1, manifest ? &hash : nullptr, index);
+  if (manifest) {
+    syncFile(output);
+    if (index.every)
+      syncFile(indexName(output));
+    manifest->addMerge(output, records, hash, ids); // NB: before inputs are removed.
   }
   for (auto id : ids)
     std::remove(std::to_string(id).data());
-}
\ No newline at end of file
+}
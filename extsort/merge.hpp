@@ -1,12 +1,81 @@
 #pragma once
+#include "index.hpp"
 #include <string>
 #include <vector>
+#include <cstdint>
 
-void mergeFiles(const std::string& output, const std::vector<int>& ids);
+// What to do with equal keys, both in sorted pieces and in every merge pass.
+enum class Aggregate
+{
+  none,   // Keep all.
+  unique, // Keep one of equal keys.
+  count   // Write KeyCount records.
+};
+
+// Record of Aggregate::count runs and output.
+// 64bit count is kept as two words, so the record has no padding: 12 bytes.
+struct KeyCount
+{
+  unsigned key;
+  unsigned countLo;
+  unsigned countHi;
+
+  uint64_t count() const { return uint64_t(countHi) << 32 | countLo; }
+  void setCount(uint64_t c)
+  {
+    countLo = unsigned(c);
+    countHi = unsigned(c >> 32);
+  }
+  bool operator<(const KeyCount& r) const { return key < r.key; }
+  bool operator==(const KeyCount& r) const { return key == r.key; }
+};
+
+// Open runs of a merge, where passes merge groups of this many runs: -records, -width and workers.
+const int maxMergeRuns = 16;
+
+inline unsigned keyOf(unsigned x) { return x; }
+inline unsigned keyOf(const KeyCount& x) { return x.key; }
+
+class Manifest;
+
+// Records [first, last) of a sorted file, an input of a merge.
+struct RunRange
+{
+  std::string name;
+  uint64_t first = 0;
+  uint64_t last = UINT64_MAX;
+};
+
+// Merge ranges of sorted files into output, see mergeNamedFiles. Done by the selected engine, see engine.hpp.
+uint64_t mergeRuns(const std::string& output, const std::vector<RunRange>& inputs, Aggregate agg = Aggregate::none,
+  long long at = -1, uint64_t* checksum = nullptr, const IndexOptions& index = IndexOptions());
+
+// mergeRuns with policies of threads and reads of the engine, instantiated for all of them.
+template<class Threads, class Reads>
+uint64_t mergeRunsWith(const std::string& output, const std::vector<RunRange>& inputs, Aggregate agg,
+  long long at, uint64_t* checksum, const IndexOptions& index);
+
+// Merge sorted files into output, a new one, or written from byte position 'at' of the existing one.
+// Inputs are kept. Returns number of records written, optionally their checksum.
+// The sparse index is written along with a new output, if asked.
+uint64_t mergeNamedFiles(const std::string& output, const std::vector<std::string>& inputs, Aggregate agg = Aggregate::none,
+  long long at = -1, uint64_t* checksum = nullptr, const IndexOptions& index = IndexOptions());
+
+// Inputs are removed when done. With a manifest the result is logged before that;
+//   when resuming a logged merge is skipped, and lost inputs throw std::runtime_error.
+void mergeFiles(const std::string& output, const std::vector<int>& ids, Aggregate agg = Aggregate::none, Manifest* manifest = nullptr,
+  const IndexOptions& index = IndexOptions());
+
+struct MergeTask
+{
+  std::vector<int> ids; // Last one is for output file.
+  Aggregate agg = Aggregate::none;
+  Manifest* manifest = nullptr;
+};
 
-inline void mergeFiles1(std::vector<int>& ids)
+inline void mergeFiles1(MergeTask& task)
 {
-  std::string output = std::to_string(ids.back());
-  ids.pop_back();
-  mergeFiles(output, ids);
+  std::string output = std::to_string(task.ids.back());
+  task.ids.pop_back();
+  mergeFiles(output, task.ids, task.agg, task.manifest);
 }
@@ -0,0 +1,285 @@
+#include "metrics.hpp"
+#include <fstream>
+#include <algorithm>
+#include <numeric>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <sys/resource.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#endif
+
+Metrics& Metrics::get()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics() :
+  m_enabled(false),
+  m_t0(std::chrono::steady_clock::now())
+{
+}
+
+double Metrics::now() const
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_t0).count();
+}
+
+int Metrics::threadId()
+{
+  static std::atomic<int> next(0);
+  thread_local int tid = next++;
+  return tid;
+}
+
+void Metrics::nameThread(const std::string& name)
+{
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(m);
+  m_threadNames.emplace(threadId(), name);
+}
+
+void Metrics::addSpan(const char* name, double ts, double dur, long long id, uint64_t bytes, const std::string& file)
+{
+  auto tid = threadId();
+  std::lock_guard<std::mutex> lock(m);
+  m_spans.push_back({ name, ts, dur, tid, id, bytes, file });
+}
+
+void Metrics::count(const char* name, uint64_t v)
+{
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(m);
+  m_counters[name] += v;
+}
+
+void Metrics::addRun(uint64_t elements)
+{
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(m);
+  m_runs.push_back(elements);
+}
+
+void Metrics::addHwCounters(const char* phase, const std::vector<std::pair<std::string, uint64_t>>& values)
+{
+  if (values.empty())
+    return;
+  std::lock_guard<std::mutex> lock(m);
+  m_hw.emplace_back(phase, values);
+}
+
+void Metrics::reset()
+{
+  std::lock_guard<std::mutex> lock(m);
+  m_spans.clear();
+  m_counters.clear();
+  m_runs.clear();
+  m_hw.clear();
+}
+
+std::map<std::string, double> Metrics::spanTotals() const
+{
+  std::map<std::string, double> res;
+  std::lock_guard<std::mutex> lock(m);
+  for (auto& s : m_spans)
+    res[s.name] += s.dur * 1e-6;
+  return res;
+}
+
+size_t Metrics::peakRss()
+{
+#if defined(__linux__)
+  std::ifstream f("/proc/self/status");
+  std::string line;
+  while (std::getline(f, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return size_t(std::stoull(line.substr(6))) * 1024;
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    return size_t(ru.ru_maxrss) * 1024;
+#elif defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return pmc.PeakWorkingSetSize;
+#endif
+  return 0;
+}
+
+void Metrics::resetPeakRss()
+{
+#if defined(__linux__)
+  std::ofstream f("/proc/self/clear_refs");
+  f << "5"; // Reset VmHWM to current RSS.
+#endif
+}
+
+static std::string quoted(const std::string& s)
+{
+  std::string res = "\"";
+  for (auto c : s)
+    if (c == '"' || c == '\\')
+      res += std::string("\\") + c;
+    else if (unsigned(c) < 0x20)
+      res += ' ';
+    else
+      res += c;
+  return res + "\"";
+}
+
+bool Metrics::writeSummary(const std::string& name) const
+{
+  std::ofstream f(name);
+  if (!f)
+    return false;
+  std::lock_guard<std::mutex> lock(m);
+  struct Stat
+  {
+    size_t count = 0;
+    double total = 0.0;
+    double max = 0.0;
+    uint64_t bytes = 0;
+  };
+  std::map<std::string, Stat> stats;
+  std::map<int, std::map<std::string, double>> perThread;
+  for (auto& s : m_spans) {
+    auto& st = stats[s.name];
+    st.count++;
+    st.total += s.dur;
+    st.max = std::max(st.max, s.dur);
+    st.bytes += s.bytes;
+    perThread[s.tid][s.name] += s.dur;
+  }
+  f << "{\n  \"spans\": {";
+  const char* sep = "\n";
+  for (auto& kv : stats) {
+    f << sep << "    " << quoted(kv.first) << ": { \"count\": " << kv.second.count
+      << ", \"total_sec\": " << kv.second.total * 1e-6 << ", \"max_sec\": " << kv.second.max * 1e-6
+      << ", \"bytes\": " << kv.second.bytes << " }";
+    sep = ",\n";
+  }
+  f << "\n  },\n  \"threads\": {";
+  sep = "\n";
+  for (auto& t : perThread) {
+    auto itName = m_threadNames.find(t.first);
+    f << sep << "    " << quoted(std::to_string(t.first)) << ": { \"name\": "
+      << quoted(itName != m_threadNames.end() ? itName->second : "") ;
+    for (auto& kv : t.second)
+      f << ", " << quoted(kv.first + "_sec") << ": " << kv.second * 1e-6;
+    f << " }";
+    sep = ",\n";
+  }
+  f << "\n  },\n  \"counters\": {";
+  sep = "\n";
+  for (auto& kv : m_counters) {
+    f << sep << "    " << quoted(kv.first) << ": " << kv.second;
+    sep = ",\n";
+  }
+  f << "\n  },\n  \"runs\": { \"count\": " << m_runs.size();
+  if (!m_runs.empty()) {
+    auto mm = std::minmax_element(m_runs.begin(), m_runs.end());
+    auto sum = std::accumulate(m_runs.begin(), m_runs.end(), uint64_t(0));
+    f << ", \"min\": " << *mm.first << ", \"max\": " << *mm.second << ", \"mean\": " << double(sum) / m_runs.size();
+  }
+  f << ", \"elements\": [";
+  for (size_t i = 0; i < m_runs.size(); i++)
+    f << (i ? ", " : "") << m_runs[i];
+  f << "] },\n  \"hw\": {";
+  sep = "\n";
+  for (auto& ph : m_hw) {
+    f << sep << "    " << quoted(ph.first) << ": {";
+    for (size_t i = 0; i < ph.second.size(); i++)
+      f << (i ? ", " : " ") << quoted(ph.second[i].first) << ": " << ph.second[i].second;
+    f << " }";
+    sep = ",\n";
+  }
+  f << "\n  },\n  \"peak_rss_bytes\": " << peakRss() << "\n}\n";
+  return bool(f);
+}
+
+bool Metrics::writeTrace(const std::string& name) const
+{
+  std::ofstream f(name);
+  if (!f)
+    return false;
+  std::lock_guard<std::mutex> lock(m);
+  f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  const char* sep = "";
+  for (auto& t : m_threadNames) {
+    f << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t.first
+      << ",\"args\":{\"name\":" << quoted(t.second + " " + std::to_string(t.first)) << "}}";
+    sep = ",\n";
+  }
+  for (auto& s : m_spans) {
+    f << sep << "{\"name\":" << quoted(s.name) << ",\"cat\":\"extsort\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.tid
+      << ",\"ts\":" << s.ts << ",\"dur\":" << s.dur << ",\"args\":{\"bytes\":" << s.bytes;
+    if (s.id >= 0)
+      f << ",\"id\":" << s.id;
+    if (!s.file.empty())
+      f << ",\"file\":" << quoted(s.file);
+    f << "}}";
+    sep = ",\n";
+  }
+  f << "\n]}\n";
+  return bool(f);
+}
+
+PerfCounters::PerfCounters()
+{
+#if defined(__linux__)
+  const std::pair<const char*, uint64_t> events[] = {
+    { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_COUNT_HW_BRANCH_MISSES },
+  };
+  for (auto& e : events) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = e.second;
+    attr.inherit = 1; // Count worker threads, those are summed up when joined.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    if (fd >= 0)
+      m_fds.emplace_back(e.first, fd);
+  }
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#if defined(__linux__)
+  for (auto& fd : m_fds)
+    close(fd.second);
+#endif
+}
+
+std::vector<std::pair<std::string, uint64_t>> PerfCounters::read() const
+{
+  std::vector<std::pair<std::string, uint64_t>> res;
+#if defined(__linux__)
+  for (auto& fd : m_fds) {
+    uint64_t v = 0;
+    if (::read(fd.second, &v, sizeof(v)) == sizeof(v))
+      res.emplace_back(fd.first, v);
+  }
+#endif
+  return res;
+}
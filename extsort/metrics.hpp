@@ -0,0 +1,137 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Instrumentation of the sort pipeline: per-thread spans, counters and sizes of runs.
+// Disabled by default, then a span or a counter costs one relaxed load.
+// Results are dumped as json summary and as Chrome trace, see chrome://tracing or ui.perfetto.dev.
+class Metrics
+{
+public:
+
+  static Metrics& get();
+
+  void enable() { m_enabled = true; }
+  bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+  double now() const; // Microseconds since start.
+  static int threadId(); // Small id of the calling thread.
+  void nameThread(const std::string& name); // Keeps the first name given.
+
+  void addSpan(const char* name, double ts, double dur, long long id, uint64_t bytes, const std::string& file);
+  void count(const char* name, uint64_t v = 1);
+  void addRun(uint64_t elements);
+  void addHwCounters(const char* phase, const std::vector<std::pair<std::string, uint64_t>>& values);
+
+  void reset(); // Forget all collected, e.g. between benchmark runs.
+  std::map<std::string, double> spanTotals() const; // Seconds by span name, summed over threads.
+
+  static size_t peakRss(); // Bytes, 0 if unknown.
+  static void resetPeakRss(); // Where supported, otherwise peak is over the process life.
+
+  bool writeSummary(const std::string& name) const;
+  bool writeTrace(const std::string& name) const;
+
+private:
+
+  Metrics();
+
+  struct SpanRec
+  {
+    const char* name;
+    double ts;
+    double dur;
+    int tid;
+    long long id;
+    uint64_t bytes;
+    std::string file;
+  };
+
+  std::atomic<bool> m_enabled;
+  std::chrono::steady_clock::time_point m_t0;
+  mutable std::mutex m;
+  std::vector<SpanRec> m_spans;
+  std::map<std::string, uint64_t> m_counters;
+  std::vector<uint64_t> m_runs;
+  std::map<int, std::string> m_threadNames;
+  std::vector<std::pair<std::string, std::vector<std::pair<std::string, uint64_t>>>> m_hw;
+};
+
+// Scoped span on the calling thread. Names are expected to be literals.
+class Span
+{
+public:
+
+  explicit Span(const char* name, long long id = -1, const std::string& file = std::string()) :
+    m_name(name), m_id(id), m_ts(Metrics::get().enabled() ? Metrics::get().now() : -1.0)
+  {
+    if (m_ts >= 0)
+      m_file = file;
+  }
+
+  ~Span()
+  {
+    if (m_ts >= 0) {
+      auto& metrics = Metrics::get();
+      metrics.addSpan(m_name, m_ts, metrics.now() - m_ts, m_id, m_bytes, m_file);
+    }
+  }
+
+  void addBytes(uint64_t bytes) { m_bytes += bytes; }
+
+private:
+
+  const char* m_name;
+  long long m_id;
+  double m_ts;
+  uint64_t m_bytes = 0;
+  std::string m_file;
+};
+
+// Hardware counters of the calling thread and threads it creates later, over perf_event_open.
+// Linux only, and only when perf_event_paranoid permits; otherwise 'read' returns nothing.
+class PerfCounters
+{
+public:
+
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  std::vector<std::pair<std::string, uint64_t>> read() const;
+
+private:
+
+  std::vector<std::pair<std::string, int>> m_fds;
+};
+
+// Top level stage of the sort: a span plus hardware counters over it.
+class Phase
+{
+public:
+
+  explicit Phase(const char* name) : m_span(name), m_name(name)
+  {
+    if (Metrics::get().enabled())
+      m_perf.reset(new PerfCounters());
+  }
+
+  ~Phase()
+  {
+    if (m_perf)
+      Metrics::get().addHwCounters(m_name, m_perf->read());
+  }
+
+private:
+
+  Span m_span;
+  const char* m_name;
+  std::unique_ptr<PerfCounters> m_perf;
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+// Heap of merge inputs by their current records, equal ones in the order of inputs.
+// Data needs operator< and operator==; it may be a key which refers to the record.
+template<class Data>
+class MinHeap
+{
+  template<class Data1 = Data>
+  struct Node
+  {
+    Data1 data;
+    int i;
+    bool operator<(const Node& r) const
+    {
+      return data < r.data || (data == r.data && i < r.i);
+    }
+  };
+
+  Node<Data>* pheap = nullptr;
+  int size = 0;
+  uint64_t nComparisons = 0;
+
+public:
+
+  MinHeap(int sz)
+  {
+    pheap = new Node<Data>[sz];
+    size = sz;
+  }
+
+  ~MinHeap()
+  {
+    delete[] pheap;
+    pheap = nullptr;
+  }
+
+  Node<Data>& operator[](int i) { return pheap[i]; }
+
+  uint64_t comparisons() const { return nComparisons; }
+
+  bool empty() const { return size == 0; }
+
+  static int left(int i) { return 2 * i + 1; }
+
+  static int right(int i) { return 2 * i + 2; }
+
+  void init()
+  {
+    for (int i = (size - 1) / 2; i >= 0; i--)
+      heapify(i);
+  }
+
+  // Drop the top, an input at its end.
+  void pop()
+  {
+    pheap[0] = pheap[--size];
+    heapify(0);
+  }
+
+  void heapify(const int i)
+  {
+    int smaller = i;
+    const int l = left(i);
+    if (l < size && (nComparisons++, pheap[l] < pheap[i]))
+      smaller = l;
+    const int r = right(i);
+    if (r < size && (nComparisons++, pheap[r] < pheap[smaller]))
+      smaller = r;
+    if (smaller != i) {
+      std::swap(pheap[i], pheap[smaller]);
+      heapify(smaller);
+    }
+  }
+};
@@ -0,0 +1,320 @@
+#include "service.hpp"
+#include "timer.hpp"
+#include <iostream>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <set>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HAS_UNIX_SOCKETS
+#endif
+
+#ifdef HAS_UNIX_SOCKETS
+
+// Connected socket, closed by the destructor. Messages are lines of text both ways.
+class Connection
+{
+public:
+
+  explicit Connection(int fd) : fd(fd) {}
+  Connection(const Connection&) = delete;
+  ~Connection()
+  {
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  bool readLine(std::string& line)
+  {
+    size_t eol;
+    while ((eol = buf.find('\n')) == std::string::npos) {
+      char tmp[4096];
+      auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+      if (n <= 0)
+        return false;
+      buf.append(tmp, size_t(n));
+    }
+    line = buf.substr(0, eol);
+    buf.erase(0, eol + 1);
+    return true;
+  }
+
+  bool writeLine(const std::string& line)
+  {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL; // A gone client must not kill the service.
+#else
+    const int flags = 0;
+#endif
+    auto s = line + "\n";
+    for (size_t pos = 0; pos < s.size(); ) {
+      auto n = ::send(fd, s.data() + pos, s.size() - pos, flags);
+      if (n <= 0)
+        return false;
+      pos += size_t(n);
+    }
+    return true;
+  }
+
+private:
+
+  int fd;
+  std::string buf;
+};
+
+static bool socketAddress(const std::string& path, sockaddr_un& addr)
+{
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+  std::strcpy(addr.sun_path, path.data());
+  return true;
+}
+
+static int connectTo(const std::string& path)
+{
+  sockaddr_un addr;
+  if (!socketAddress(path, addr))
+    return -1;
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listenOn(const std::string& path)
+{
+  sockaddr_un addr;
+  if (!socketAddress(path, addr))
+    return -1;
+  int other = connectTo(path);
+  if (other >= 0) {
+    ::close(other);
+    return -1; // Another service is there.
+  }
+  ::unlink(path.data()); // Left by a crash.
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  const mode_t mask = ::umask(077); // Only the owner may connect, from the moment the socket exists.
+  const bool bound = ::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+  ::umask(mask);
+  if (!bound || ::chmod(path.data(), 0600) != 0 || ::listen(fd, 64) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Slots of the budget: a job gets one when it is first in the queue by priority and arrival.
+// Each slot is 1/maxJobs of memory and threads, so a lone job never holds back the ones after it.
+class Scheduler
+{
+public:
+
+  explicit Scheduler(const ServiceOptions& opt) :
+    maxJobs(opt.maxJobs),
+    memSize(opt.memSize / opt.maxJobs),
+    numThreads(std::max(1, opt.numThreads / opt.maxJobs))
+  {}
+
+  // Share of a job.
+  const size_t memSize;
+  const int numThreads;
+
+  void enter(int priority)
+  {
+    std::unique_lock<std::mutex> lock(m);
+    const Ticket t{ priority, next++ };
+    waiting.insert(t);
+    cv.wait(lock, [&] { return running < maxJobs && *waiting.begin() == t; });
+    waiting.erase(t);
+    running++;
+    cv.notify_all();
+  }
+
+  void leave()
+  {
+    std::lock_guard<std::mutex> lock(m);
+    running--;
+    cv.notify_all();
+  }
+
+  // Clients are connected until their jobs are done.
+  void connect()
+  {
+    std::lock_guard<std::mutex> lock(m);
+    clients++;
+  }
+
+  void disconnect()
+  {
+    std::lock_guard<std::mutex> lock(m);
+    clients--;
+    cv.notify_all();
+  }
+
+  void waitIdle()
+  {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this] { return clients == 0; });
+  }
+
+private:
+
+  struct Ticket
+  {
+    int priority;
+    uint64_t seq;
+    bool operator<(const Ticket& r) const { return priority > r.priority || (priority == r.priority && seq < r.seq); }
+    bool operator==(const Ticket& r) const { return seq == r.seq; }
+  };
+
+  const int maxJobs;
+  std::mutex m;
+  std::condition_variable cv;
+  std::set<Ticket> waiting;
+  uint64_t next = 0;
+  int running = 0;
+  int clients = 0;
+};
+
+// Args go through the shell as they are.
+static std::string shellQuote(const std::string& s)
+{
+  std::string res = "'";
+  for (auto c : s)
+    res += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  return res + "'";
+}
+
+static void serveClient(int fd, int listenFd, const ServiceOptions& opt, Scheduler& sched, std::atomic<bool>& stopping)
+{
+  Connection c(fd);
+  std::string line;
+  if (!c.readLine(line)) {
+    sched.disconnect();
+    return;
+  }
+  std::stringstream ss(line);
+  std::string kind;
+  int priority = 0;
+  size_t nArgs = 0;
+  ss >> kind >> priority >> nArgs;
+  if (kind == "stop") {
+    stopping = true;
+    ::shutdown(listenFd, SHUT_RDWR); // Wake up accept.
+    c.writeLine("ok");
+    sched.disconnect();
+    return;
+  }
+  std::string dir, arg;
+  std::string command;
+  bool ok = kind == "sort" && c.readLine(dir);
+  for (size_t i = 0; ok && i < nArgs; i++) {
+    ok = c.readLine(arg);
+    command += " " + shellQuote(arg);
+  }
+  if (ok) {
+    sched.enter(priority);
+    command = "cd " + shellQuote(dir) + " && " + shellQuote(opt.command) + " -m " + std::to_string(sched.memSize / sizeof(unsigned)) +
+      " -t " + std::to_string(sched.numThreads) + command + " > extsort.log 2>&1";
+    Timer timer;
+    int status = std::system(command.data());
+    double seconds = timer;
+    sched.leave();
+    const int code = status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    std::cout << "Job in " << dir << ", priority " << priority << ": exit code " << code << ", " << seconds << "sec\n";
+    c.writeLine(std::to_string(code) + " " + std::to_string(seconds));
+  }
+  sched.disconnect();
+}
+
+bool runService(const ServiceOptions& opt)
+{
+  int fd = listenOn(opt.socket);
+  if (fd < 0) {
+    std::cerr << "Cannot listen on " << opt.socket << "\n";
+    return false;
+  }
+  std::cout << "Service on " << opt.socket << ": " << opt.maxJobs << " jobs at once, each one with " <<
+    opt.memSize / opt.maxJobs << " bytes and " << std::max(1, opt.numThreads / opt.maxJobs) << " threads\n";
+  Scheduler sched(opt);
+  std::atomic<bool> stopping(false);
+  while (!stopping) {
+    int client = ::accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR && !stopping)
+        continue;
+      break;
+    }
+    sched.connect();
+    std::thread(serveClient, client, fd, std::cref(opt), std::ref(sched), std::ref(stopping)).detach();
+  }
+  sched.waitIdle();
+  ::close(fd);
+  ::unlink(opt.socket.data());
+  std::cout << "Service is stopped\n";
+  return true;
+}
+
+bool submitJob(const std::string& socket, int priority, const std::string& dir, const std::vector<std::string>& args,
+  int& exitCode, double& seconds)
+{
+  int fd = connectTo(socket);
+  if (fd < 0)
+    return false;
+  Connection c(fd);
+  bool ok = c.writeLine("sort " + std::to_string(priority) + " " + std::to_string(args.size())) && c.writeLine(dir);
+  for (auto& arg : args)
+    ok = ok && c.writeLine(arg);
+  std::string line;
+  if (!ok || !c.readLine(line))
+    return false;
+  std::stringstream ss(line);
+  return bool(ss >> exitCode >> seconds);
+}
+
+bool stopService(const std::string& socket)
+{
+  int fd = connectTo(socket);
+  if (fd < 0)
+    return false;
+  Connection c(fd);
+  std::string line;
+  return c.writeLine("stop") && c.readLine(line);
+}
+
+#else
+
+bool runService(const ServiceOptions& opt)
+{
+  std::cerr << "Sort service needs Unix sockets, not supported on this platform\n";
+  return false;
+}
+
+bool submitJob(const std::string&, int, const std::string&, const std::vector<std::string>&, int&, double&)
+{
+  return false;
+}
+
+bool stopService(const std::string&)
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Long running sort service on a local socket, shared by many clients.
+// Every job runs as a child process in the dir of its client, with 1/maxJobs of one memory and thread budget:
+//   at most maxJobs run at once, others wait in the queue by priority, then in order of arrival.
+// Jobs do not share a task pool: the run generation and merges of every job are scheduled by its own process,
+//   and there is no I/O budget apart from the number of jobs at once.
+struct ServiceOptions
+{
+  std::string socket; // Path of the Unix socket.
+  std::string command; // The executable to run jobs.
+  size_t memSize = 0; // Bytes for all jobs.
+  int numThreads = 0; // For all jobs.
+  int maxJobs = 1;
+};
+
+// Serve until a client asks to stop, then finish the queue. Returns false if the socket cannot be used.
+bool runService(const ServiceOptions& opt);
+
+// Run a sort with args in dir by the service and wait for it; higher priority goes first.
+// Output of the job is in 'extsort.log' of dir. Returns false if the service cannot be reached.
+bool submitJob(const std::string& socket, int priority, const std::string& dir, const std::vector<std::string>& args,
+  int& exitCode, double& seconds);
+
+// Ask the service to stop when its queue is done.
+bool stopService(const std::string& socket);
@@ -2,6 +2,8 @@
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <cmath>
+#include <atomic>
 
 typedef unsigned Data;
 
@@ -28,17 +30,275 @@ void generateFile1(const std::string& name, size_t size)
   std::cout << "FileWriteBuf was waiting: " << buf.mainWaits() << "sec.\n";
 }
 
-template< class Data, class Compare>
-bool isSortedStream(File& f, Compare comp)
+// Counter based generator (splitmix64 finalizer): element i does not depend on others,
+//   so any block of the file can be generated by any thread.
+static uint64_t mix64(uint64_t x)
 {
-  auto read = [&f](Data& e) { return f && 1 == f.read(e); };
-  Data prev, next;
-  if (!read(prev))
-    return true;
-  while (read(next)) {
-    if (!comp(prev, next))
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+const std::vector<std::string>& distributionNames()
+{
+  static const std::vector<std::string> names = {
+    "uniform", "sorted", "reverse", "nearly-sorted", "few-unique", "zipf", "equal" };
+  return names;
+}
+
+bool parseDistribution(const std::string& name, Distribution& dist)
+{
+  auto& names = distributionNames();
+  auto itr = std::find(names.begin(), names.end(), name);
+  if (itr == names.end())
+    return false;
+  dist = Distribution(itr - names.begin());
+  return true;
+}
+
+static Data generateOne(Distribution dist, size_t i, size_t size, uint64_t seed)
+{
+  const uint64_t h = mix64(seed * 0x100000001b3ULL + i);
+  switch (dist) {
+  case Distribution::uniform:
+    return Data(h >> 32);
+  case Distribution::sorted:
+    return Data(i);
+  case Distribution::reverse:
+    return Data(size - 1 - i);
+  case Distribution::nearlySorted: // 1% of elements are moved randomly.
+    return h % 100 == 0 ? Data(mix64(h) % size) : Data(i);
+  case Distribution::fewUnique: // 16 distinct values.
+    return Data(mix64(seed + h % 16) >> 32);
+  case Distribution::zipf: {
+    // Continuous approximation of Zipf s=1 over 1M keys: rank = (K+1)^u.
+    const double K = 1024 * 1024;
+    const double u = double(h >> 11) / double(1ULL << 53);
+    auto rank = uint64_t(std::exp(u * std::log(K + 1.0)));
+    return Data(mix64(seed + rank) >> 32);
+  }
+  case Distribution::equal:
+    return Data(42);
+  }
+  return 0;
+}
+
+void generateFile(const std::string& name, size_t size, Distribution dist, int numThreads, uint64_t seed)
+{
+  {
+    File f(name, "wb"s); // Create or truncate.
+  }
+  const size_t blockSize = 1024 * 1024; // Elements.
+  const size_t nBlocks = (size + blockSize - 1) / blockSize;
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    File f(name, "r+b"s);
+    std::vector<NoInit<Data>> buf;
+    for (size_t b = next++; b < nBlocks; b = next++) {
+      const size_t first = b * blockSize;
+      buf.resize(std::min(blockSize, size - first));
+      for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = generateOne(dist, first + i, size, seed);
+      f.seek(first * sizeof(Data));
+      f.write(buf);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < std::max(1, numThreads); t++)
+    threads.emplace_back(work);
+  work();
+  for (auto& t : threads)
+    t.join();
+}
+
+// Order independent fingerprint of a multiset: count and two sums of differently hashed values.
+// Also the least and the greatest value, they are not compared.
+struct Fingerprint
+{
+  uint64_t count = 0;
+  uint64_t sum1 = 0;
+  uint64_t sum2 = 0;
+  Data min = ~Data(0);
+  Data max = 0;
+
+  void add(Data x, uint64_t n = 1)
+  {
+    count += n;
+    sum1 += n * mix64(x);
+    sum2 += n * mix64(uint64_t(x) ^ 0x5bd1e9955bd1e995ULL);
+    min = std::min(min, x);
+    max = std::max(max, x);
+  }
+  void add(const KeyCount& x)
+  {
+    add(x.key, x.count());
+  }
+  void add(const Fingerprint& r)
+  {
+    count += r.count;
+    sum1 += r.sum1;
+    sum2 += r.sum2;
+    min = std::min(min, r.min);
+    max = std::max(max, r.max);
+  }
+  bool operator==(const Fingerprint& r) const
+  {
+    return count == r.count && sum1 == r.sum1 && sum2 == r.sum2;
+  }
+};
+
+// Result of streaming over records [begin, end) of one file.
+struct RangeCheck
+{
+  Fingerprint fp;
+  bool readOk = true;
+  size_t unsortedAt = SIZE_MAX; // First record out of order with its predecessor.
+  Data first = 0;
+  Data last = 0;
+};
+
+enum class Order { any, ascending, strict };
+
+static bool inOrder(Order order, Data prev, Data x)
+{
+  return order == Order::any || prev < x || (order == Order::ascending && prev == x);
+}
+
+template<class Rec>
+static void checkRange(const std::string& name, size_t begin, size_t end, Order order, RangeCheck& res)
+{
+  if (begin >= end)
+    return;
+  File f(name, "rb"s);
+  if (!f || !f.seek(begin * sizeof(Rec))) {
+    res.readOk = false;
+    return;
+  }
+  std::vector<NoInit<Rec>> buf;
+  Data prev = 0;
+  for (size_t pos = begin; pos < end; ) {
+    buf.resize(std::min(size_t(1024 * 1024), end - pos));
+    if (f.read(buf) != buf.size()) {
+      res.readOk = false;
+      return;
+    }
+    for (size_t i = 0; i < buf.size(); i++) {
+      const Rec x = buf[i];
+      res.fp.add(x);
+      if (pos + i == begin)
+        res.first = keyOf(x);
+      else if (res.unsortedAt == SIZE_MAX && !inOrder(order, prev, keyOf(x)))
+        res.unsortedAt = pos + i;
+      prev = keyOf(x);
+    }
+    pos += buf.size();
+  }
+  res.last = prev;
+}
+
+// Split n records of a file for numThreads, check the ranges in parallel and join results.
+// The last key of previous files, if any, continues the order.
+template<class Rec>
+static bool checkFile(const std::string& name, size_t n, int numThreads, Order order, Fingerprint& fp, bool& hasPrev, Data& prevLast)
+{
+  std::vector<RangeCheck> checks(numThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; t++)
+    threads.emplace_back([&, t]() {
+      checkRange<Rec>(name, n * t / numThreads, n * (t + 1) / numThreads, order, checks[t]);
+    });
+  for (auto& t : threads)
+    t.join();
+
+  for (int t = 0; t < numThreads; t++) {
+    if (!checks[t].readOk) {
+      std::cerr << "Cannot read " << name << ".\n";
       return false;
-    prev = next;
+    }
+    fp.add(checks[t].fp);
+    const size_t begin = n * t / numThreads;
+    if (n * (t + 1) / numThreads == begin)
+      continue;
+    size_t unsortedAt = checks[t].unsortedAt;
+    if (unsortedAt == SIZE_MAX && hasPrev && !inOrder(order, prevLast, checks[t].first))
+      unsortedAt = begin; // Across the boundary of ranges.
+    hasPrev = true;
+    prevLast = checks[t].last;
+    if (unsortedAt != SIZE_MAX) {
+      std::cerr << "Result " << name << " is not sorted at element " << unsortedAt << ".\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Result of Aggregate::unique holds exactly the distinct keys of input, its strict order is checked already.
+// One input pass by all threads sets the bits of its keys in a bitmap over the key range of the result, up to 512MB;
+//   then the fingerprint of the set bits must be the one of the result. Keys out of the range are missing in it.
+static bool checkDistinct(const std::string& origName, size_t n, const Fingerprint& resFp, int numThreads)
+{
+  const uint64_t lo = resFp.min;
+  const uint64_t range = resFp.count ? uint64_t(resFp.max) - lo + 1 : 0;
+  std::vector<std::atomic<uint64_t>> bits((range + 63) / 64);
+  std::atomic<bool> readOk(true);
+  std::atomic<uint64_t> outside(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; t++)
+    threads.emplace_back([&, t]() {
+      const size_t begin = n * t / numThreads, end = n * (t + 1) / numThreads;
+      if (begin == end)
+        return;
+      File f(origName, "rb"s);
+      if (!f || !f.seek(begin * sizeof(Data))) {
+        readOk = false;
+        return;
+      }
+      std::vector<NoInit<Data>> buf;
+      uint64_t out = 0;
+      for (size_t pos = begin; pos < end; pos += buf.size()) {
+        buf.resize(std::min(size_t(1024 * 1024), end - pos));
+        if (f.read(buf) != buf.size()) {
+          readOk = false;
+          return;
+        }
+        for (Data k : buf) {
+          const uint64_t i = k - lo; // Huge for keys less than lo.
+          if (i < range)
+            bits[i / 64].fetch_or(uint64_t(1) << i % 64, std::memory_order_relaxed);
+          else
+            out++;
+        }
+      }
+      outside += out;
+    });
+  for (auto& t : threads)
+    t.join();
+  if (!readOk) {
+    std::cerr << "Cannot read " << origName << ".\n";
+    return false;
+  }
+  if (outside) {
+    std::cerr << "Result misses keys of input out of its range [" << resFp.min << ", " << resFp.max << "].\n";
+    return false;
+  }
+  std::vector<Fingerprint> fps(numThreads);
+  threads.clear();
+  for (int t = 0; t < numThreads; t++)
+    threads.emplace_back([&, t]() {
+      for (size_t w = bits.size() * t / numThreads; w < bits.size() * (t + 1) / numThreads; w++)
+        for (uint64_t x = bits[w].load(std::memory_order_relaxed), b = 0; x; x >>= 1, b++)
+          if (x & 1)
+            fps[t].add(Data(lo + w * 64 + b));
+    });
+  for (auto& t : threads)
+    t.join();
+  Fingerprint distinctFp;
+  for (auto& fp : fps)
+    distinctFp.add(fp);
+  if (!(distinctFp == resFp)) {
+    std::cerr << "Result is not the set of distinct keys of input: " << resFp.count << " keys, " << distinctFp.count << " in input.\n";
+    return false;
   }
   return true;
 }
@@ -62,34 +322,63 @@ void doReferenceSort(const std::string& origName, const std::string& resName)
   }
 }
 
-bool makeTest(const std::string& origName, const std::string& resName)
+bool makeTest(const std::string& origName, const std::string& resName, int numThreads, Aggregate agg)
 {
-  File forig(origName, "rb"s);
-  size_t fileSize = forig.size();
-  try
-  {
-    size_t bufSize = fileSize / sizeof(Data);
-    std::vector<NoInit<Data>> buf(bufSize);
-    forig.read(buf);
-    std::sort(buf.begin(), buf.end());
+  return makeTest(origName, std::vector<std::string>{ resName }, numThreads, agg);
+}
 
-    FileReadBuf<Data> fres(resName);
-    if (fileSize != fres.size())
+bool makeTest(const std::string& origName, const std::vector<std::string>& resNames, int numThreads, Aggregate agg)
+{
+  size_t origSize = 0, resSize = 0;
+  std::vector<size_t> resSizes;
+  {
+    File forig(origName, "rb"s);
+    if (!forig) {
+      std::cerr << "Cannot open input file.\n";
       return false;
-    Data x;
-    for (size_t i = 0; i < bufSize; i++) {
-      if (!fres.read(x) || x != buf[i])
+    }
+    origSize = forig.size();
+    for (auto& name : resNames) {
+      File fres(name, "rb"s);
+      if (!fres) {
+        std::cerr << "Cannot open result file " << name << ".\n";
         return false;
+      }
+      resSizes.push_back(fres.size());
+      resSize += resSizes.back();
     }
-    return true;
   }
-  catch (const std::bad_alloc&)
-  {
-    std::cerr << "Cannot get mem buf enough to sort full input file. Just check result is sorted.\n";
-    File fres(resName, "rb"s);
-    if (fileSize != fres.size())
+  const size_t recSize = agg == Aggregate::count ? sizeof(KeyCount) : sizeof(Data);
+  if (agg == Aggregate::none ? origSize != resSize : resSize > origSize / sizeof(Data) * recSize || resSize % recSize) {
+    std::cerr << "Result size " << resSize << " does not match input size " << origSize << ".\n";
+    return false;
+  }
+
+  // Both files are streamed in ranges by all threads, with constant memory.
+  const size_t n = origSize / sizeof(Data);
+  if (numThreads <= 0)
+    numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+  numThreads = int(std::max(size_t(1), std::min(size_t(numThreads), n / (1024 * 1024) + 1)));
+  Fingerprint origFp, resFp;
+  bool hasPrev = false;
+  Data prevLast = 0;
+  if (agg != Aggregate::unique && !checkFile<Data>(origName, n, numThreads, Order::any, origFp, hasPrev, prevLast))
+    return false; // Input of Aggregate::unique is read by checkDistinct, over the key range of the result.
+  hasPrev = false; // Results continue the order of each other.
+  for (size_t i = 0; i < resNames.size(); i++) {
+    if (agg == Aggregate::count) {
+      if (!checkFile<KeyCount>(resNames[i], resSizes[i] / recSize, numThreads, Order::strict, resFp, hasPrev, prevLast))
+        return false;
+    }
+    else if (!checkFile<Data>(resNames[i], resSizes[i] / recSize, numThreads, agg == Aggregate::unique ? Order::strict : Order::ascending,
+      resFp, hasPrev, prevLast))
       return false;
-    return isSortedStream<Data>(fres, std::less_equal<Data>());
   }
-  return false;
+  if (agg == Aggregate::unique)
+    return checkDistinct(origName, n, resFp, numThreads);
+  if (!(origFp == resFp)) {
+    std::cerr << "Result is not a permutation of input.\n";
+    return false;
+  }
+  return true;
 }
@@ -1,10 +1,28 @@
 #pragma once
 #include "file.hpp"
+#include "merge.hpp"
+#include <cstdint>
 
 void generateSortedFile(const std::string& name, size_t size);
 
 void generateFile1(const std::string& name, size_t size);
 
+enum class Distribution { uniform, sorted, reverse, nearlySorted, fewUnique, zipf, equal };
+
+const std::vector<std::string>& distributionNames();
+bool parseDistribution(const std::string& name, Distribution& dist);
+
+// Any size, written by numThreads in parallel blocks. Same seed gives same file.
+void generateFile(const std::string& name, size_t size, Distribution dist, int numThreads, uint64_t seed = 1);
+
 void doReferenceSort(const std::string& origName, const std::string& resName);
 
-bool makeTest(const std::string& origName, const std::string& resName);
+// One parallel streaming pass over both files: result is sorted, also across ranges of threads,
+//   and has the same multiset fingerprint as input. Memory does not depend on file sizes.
+// With Aggregate::count keys weighted by their counts make the fingerprint;
+//   with Aggregate::unique the result is streamed first, then the one input pass sets the keys in a bitmap over the key range
+//   of the result, up to 512MB, whose fingerprint must be the one of the result.
+bool makeTest(const std::string& origName, const std::string& resName, int numThreads = 0, Aggregate agg = Aggregate::none);
+
+// Same for the result split into several files, e.g. shards: each one continues the order of the previous one.
+bool makeTest(const std::string& origName, const std::vector<std::string>& resNames, int numThreads = 0, Aggregate agg = Aggregate::none);
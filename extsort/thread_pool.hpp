@@ -1,10 +1,12 @@
 #pragma once
 #include "timer.hpp"
+#include "metrics.hpp"
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <functional>
 
 template<class Data, class Function>
 class ThreadPool
@@ -16,11 +18,13 @@ class ThreadPool
     ThreadPool<Data, Function>& pool;
     Function* func;
     Data data;
-    bool dataLoaded = false;
+    int index;
+    bool dataLoaded;
 
   public:
 
-    Thread(ThreadPool<Data, Function>& tp, Function f) : pool(tp), func(f) {}
+    // Thread stays busy until the pool's init is done, see 'run'.
+    Thread(ThreadPool<Data, Function>& tp, Function f, int i) : pool(tp), func(f), index(i), dataLoaded(bool(tp.init)) {}
 
     Data& setup()
     {
@@ -48,6 +52,10 @@ class ThreadPool
 
     void run()
     {
+      if (pool.init) {
+        pool.init(index, data);
+        pool.notify([this]() { setLoaded(false); });
+      }
       while (true) {
         pool.wait([this] { return isLoaded() || pool.isTerminating(); });
         if (pool.isTerminating())
@@ -65,17 +73,21 @@ class ThreadPool
   std::vector<Thread<Data, Function>> datas;
   std::vector<std::thread> threads;
 
+  std::function<void(int, Data&)> init;
   double mainThreadWaits = 0.0;
 
 public:
 
-  ThreadPool(int sz, Function f)
+  // Optional 'init' is called in each worker thread before its first job, e.g. to pin it
+  //   or to first-touch its data on the local NUMA node. The worker is not free until then.
+  ThreadPool(int sz, Function f, std::function<void(int, Data&)> initFunc = nullptr) :
+    init(std::move(initFunc))
   {
     terminating = false;
     datas.reserve(sz);
     threads.reserve(sz);
     for (int t = 0; t < sz; t++) {
-      datas.emplace_back(*this, f);
+      datas.emplace_back(*this, f, t);
       threads.emplace_back(&Thread<Data, Function>::run, &datas[t]);
     }
   }
@@ -90,6 +102,7 @@ public:
   auto& waitFree()
   {
     Timer t;
+    Span span("wait");
     int tid = -1;
     wait([this, &tid] {
       int busy = 0;
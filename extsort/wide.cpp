@@ -0,0 +1,295 @@
+#include "wide.hpp"
+#include "thread_pool.hpp"
+#include "file.hpp"
+#include "timer.hpp"
+#include "metrics.hpp"
+#include "min_heap.hpp"
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <cstring>
+#include <climits>
+
+// Key of a record and its index in the piece, what the sort moves instead of the record.
+struct Tag
+{
+  unsigned key;
+  uint32_t index;
+  bool operator<(const Tag& r) const { return key < r.key || (key == r.key && index < r.index); }
+};
+
+static unsigned wideKey(const char* p)
+{
+  unsigned key;
+  std::memcpy(&key, p, sizeof(key));
+  return key;
+}
+
+// Records go out over a buffer of whole records.
+class WideWriter
+{
+public:
+
+  WideWriter(const std::string& name, size_t width) : file(name, "wb"s), width(width)
+  {
+    ok = file;
+    buf.resize(std::max(size_t(1), size_t(1024 * 1024) / width) * width);
+  }
+
+  void write(const char* p)
+  {
+    std::memcpy(buf.data() + pos, p, width);
+    pos += width;
+    records++;
+    if (pos == buf.size())
+      flush();
+  }
+
+  // False if anything failed.
+  bool close()
+  {
+    flush();
+    file.close();
+    return ok;
+  }
+
+  uint64_t size() const { return records; }
+
+private:
+
+  void flush()
+  {
+    if (ok && pos)
+      ok = file.write(buf.data(), pos) == pos;
+    pos = 0;
+  }
+
+  File file;
+  size_t width;
+  bool ok = false;
+  uint64_t records = 0;
+  size_t pos = 0;
+  std::vector<NoInit<char>> buf;
+};
+
+// Records come in over a buffer of whole records.
+class WideReader
+{
+public:
+
+  WideReader(const std::string& name, size_t width, size_t bufSize) : file(name, "rb"s), name(name), width(width)
+  {
+    if (!file)
+      throw std::runtime_error("Cannot open " + name);
+    buf.resize(std::max(size_t(1), bufSize / width) * width);
+  }
+
+  // Next record, nullptr at the end.
+  const char* next()
+  {
+    if (pos == end) {
+      end = file.read(buf.data(), buf.size());
+      pos = 0;
+      if (end % width)
+        throw std::runtime_error("Broken record at the end of " + name);
+      if (end == 0)
+        return nullptr;
+    }
+    pos += width;
+    return buf.data() + pos - width;
+  }
+
+private:
+
+  File file;
+  std::string name;
+  size_t width;
+  size_t pos = 0;
+  size_t end = 0;
+  std::vector<char> buf;
+};
+
+struct WideChunk
+{
+  int uid;
+  size_t width;
+  Aggregate agg;
+  std::atomic<bool>* failed;
+  std::vector<NoInit<char>> data; // Records as they are read.
+  std::vector<Tag> tags;
+};
+
+static void sortWidePiece(WideChunk& chunk)
+{
+  Metrics::get().nameThread("sort worker");
+  const char* d = reinterpret_cast<const char*>(chunk.data.data());
+  const size_t n = chunk.data.size() / chunk.width;
+  {
+    Span span("sort", chunk.uid);
+    span.addBytes(n * sizeof(Tag));
+    chunk.tags.resize(n);
+    for (size_t i = 0; i < n; i++)
+      chunk.tags[i] = Tag{ wideKey(d + i * chunk.width), uint32_t(i) };
+    std::sort(chunk.tags.begin(), chunk.tags.end());
+    if (chunk.agg == Aggregate::unique)
+      chunk.tags.erase(std::unique(chunk.tags.begin(), chunk.tags.end(), [](const Tag& a, const Tag& b) { return a.key == b.key; }),
+        chunk.tags.end());
+  }
+  Span span("write", chunk.uid);
+  const auto name = std::to_string(chunk.uid);
+  WideWriter out(name, chunk.width);
+  for (auto& tag : chunk.tags) // The permutation pass: every record is moved once, into the write buffer.
+    out.write(d + size_t(tag.index) * chunk.width);
+  if (!out.close()) {
+    std::cerr << "Cannot write " << name << "\n";
+    *chunk.failed = true;
+  }
+  span.addBytes(out.size() * chunk.width);
+}
+
+// Sort input into pieces "0", "1"... of at most memSize / numThreads bytes with their tags. Returns their number.
+static int createWidePieces(const std::string& input, size_t memSize, int numThreads, size_t width, Aggregate agg)
+{
+  Timer timer;
+  Phase phase("run generation");
+  File f(input, "rb"s);
+  if (!f)
+    throw std::runtime_error("Cannot open " + input);
+  const size_t bufSize = std::min(std::max(size_t(1), memSize / numThreads / (width + sizeof(Tag))), size_t(UINT32_MAX)); // Records.
+  std::cout << "Wide records: width = " << width << ", mem size = " << memSize << "(" << double(memSize) / (1024.0 * 1024.0) << "M),"
+    << " buf size = " << bufSize << "\n";
+  std::atomic<bool> failed(false);
+  ThreadPool<WideChunk, decltype(sortWidePiece)> pool(numThreads, sortWidePiece);
+  int uid = 0;
+  uint64_t records = 0;
+  for (;; uid++) {
+    auto& t = pool.waitFree();
+    auto& chunk = t.setup();
+    chunk.uid = uid;
+    chunk.width = width;
+    chunk.agg = agg;
+    chunk.failed = &failed;
+    size_t loadedSize = 0;
+    {
+      Span span("read", uid, input);
+      chunk.data.resize(bufSize * width);
+      loadedSize = f.read(chunk.data);
+      chunk.data.resize(loadedSize);
+      span.addBytes(loadedSize);
+    }
+    if (loadedSize % width)
+      throw std::runtime_error("Size of " + input + " is not a multiple of the record width");
+    if (loadedSize == 0)
+      break;
+    records += loadedSize / width;
+    Metrics::get().addRun(loadedSize / width);
+    t.start();
+    if (loadedSize < bufSize * width) {
+      uid++;
+      break;
+    }
+  }
+  pool.terminate();
+  if (failed)
+    throw std::runtime_error("Cannot write sorted pieces");
+  std::cout << "Records: " << records << ", pieces: " << uid << "\n";
+  std::cout << "Partial sort: " << timer << "sec. Main thread pool waits: " << pool.mainWaits() << "\n";
+  return uid;
+}
+
+// Current record of a merge input by its key; equal keys go in the order of inputs, see MinHeap.
+struct WideKey
+{
+  unsigned key;
+  const char* rec;
+  bool operator<(const WideKey& r) const { return key < r.key; }
+  bool operator==(const WideKey& r) const { return key == r.key; }
+};
+
+// Merge sorted runs into output and remove them. Equal keys go in the order of runs, so the merge is stable.
+// Returns records written.
+static uint64_t mergeWideRuns(const std::vector<std::string>& names, const std::string& output, size_t memSize,
+  size_t width, Aggregate agg)
+{
+  Span span("merge", -1, output);
+  const size_t bufSize = std::max(size_t(64 * 1024), memSize / (names.size() + 1));
+  std::vector<std::unique_ptr<WideReader>> ins;
+  std::vector<const char*> firsts; // Records of inputs.
+  for (auto& name : names) {
+    ins.emplace_back(new WideReader(name, width, bufSize));
+    if (auto rec = ins.back()->next())
+      firsts.push_back(rec);
+    else
+      ins.pop_back(); // Empty run.
+  }
+  MinHeap<WideKey> heap(int(ins.size()));
+  for (int i = 0; i < int(ins.size()); i++) {
+    heap[i].data = WideKey{ wideKey(firsts[i]), firsts[i] };
+    heap[i].i = i;
+  }
+  heap.init();
+
+  WideWriter out(output, width);
+  bool hasLast = false;
+  unsigned lastKey = 0;
+  while (!heap.empty()) {
+    auto& top = heap[0];
+    if (agg != Aggregate::unique || !hasLast || top.data.key != lastKey) {
+      out.write(top.data.rec);
+      lastKey = top.data.key;
+      hasLast = true;
+    }
+    if (auto rec = ins[top.i]->next()) {
+      top.data = WideKey{ wideKey(rec), rec };
+      heap.heapify(0);
+    }
+    else
+      heap.pop();
+  }
+  if (!out.close())
+    throw std::runtime_error("Cannot write " + output);
+  span.addBytes(out.size() * width);
+  Metrics::get().count("heap_comparisons", heap.comparisons());
+  Metrics::get().count("merge_bytes", out.size() * width);
+  ins.clear();
+  for (auto& name : names)
+    std::remove(name.data());
+  return out.size();
+}
+
+void sortWideRecords(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  size_t width,
+  Aggregate agg
+)
+{
+  if (width < sizeof(unsigned))
+    throw std::runtime_error("Wide records need at least " + std::to_string(sizeof(unsigned)) + " bytes for the key");
+  if (agg == Aggregate::count)
+    throw std::runtime_error("Wide records cannot be counted");
+  const int nRuns = createWidePieces(input, memSize, numThreads, width, agg);
+  Timer timer;
+  Phase phase("merge phase");
+  const size_t maxRuns = maxMergeRuns;
+  std::vector<std::string> names;
+  for (int i = 0; i < nRuns; i++)
+    names.push_back(std::to_string(i));
+  // Every pass merges groups of neighbour runs into runs in the same order, to keep the merge stable.
+  for (int next = nRuns; names.size() > maxRuns; ) {
+    std::vector<std::string> names2;
+    for (size_t i = 0; i < names.size(); i += maxRuns) {
+      std::vector<std::string> group(names.begin() + i, names.begin() + std::min(names.size(), i + maxRuns));
+      names2.push_back(std::to_string(next++));
+      mergeWideRuns(group, names2.back(), memSize, width, agg);
+    }
+    names.swap(names2);
+  }
+  const uint64_t records = mergeWideRuns(names, output, memSize, width, agg);
+  std::cout << "Merge: " << records << " records, " << timer << "sec.\n";
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "merge.hpp"
+#include <string>
+
+// Sort records of 'width' bytes by their first 32bit word, an unsigned key like the elements of the engine,
+//   within memSize bytes. The sort is stable: records of equal keys keep their order of input.
+// A sorted piece sorts compact (key, index) tags only, then gathers the records in one pass of the permutation
+//   into the write buffer. The merge compares keys cached in its heap and moves every record once, as a block of bytes.
+// Aggregate::unique keeps the first of equal keys, Aggregate::count is not supported.
+// Throws std::runtime_error if a file cannot be read or written.
+void sortWideRecords(
+  const std::string& input,
+  const std::string& output,
+  size_t memSize,
+  int numThreads,
+  size_t width,
+  Aggregate agg = Aggregate::none
+);
@@ -2,36 +2,156 @@
 #include "extsort/extsort.hpp"
 #include "extsort/test.hpp"
 #include "extsort/timer.hpp"
+#include "extsort/metrics.hpp"
+#include "extsort/service.hpp"
+#include "extsort/job_dir.hpp"
+#include "extsort/lines.hpp"
+#include "extsort/wide.hpp"
+#include "extsort/engine.hpp"
 #include <thread>
 #include <iostream>
 #include <string>
+#include <stdexcept>
 
 int main(int argc, const char* argv[])
 {
 #ifdef _DEBUG
   __debugbreak();
 #endif
+  CmdOptions cmd(argc, argv);
+
+  // "-" is stdin or stdout, see File.
+  const std::string testName = cmd.get_option("-i", "input");
+  const std::string resultName = cmd.get_option("-o", "output");
+  if (resultName == "-")
+    std::cout.rdbuf(std::cerr.rdbuf()); // Logs go to stderr, stdout is for data.
+  std::vector<std::string> notForStreams;
+  if (testName == "-")
+    notForStreams = { "--gen1g", "--gen", "-n", "--ref", "--test", "-manifest", "--resume", "-delta", "-workers", "-worker" };
+  if (resultName == "-")
+    notForStreams.insert(notForStreams.end(), { "--ref", "--test", "-manifest", "--resume", "-delta", "-workers", "-worker", "-shards", "-index", "-lookup", "-range" });
+  for (auto& option : notForStreams)
+    if (cmd.exists_option(option)) {
+      std::cerr << "Option " << option << " needs files, not stdin or stdout\n";
+      return 1;
+    }
+  RecordFormat format = RecordFormat::lines;
+  size_t width = 0;
+  if (cmd.exists_option("-records") || cmd.exists_option("-width")) {
+    if (cmd.exists_option("-records") && !parseRecordFormat(cmd.get_option("-records"), format)) {
+      std::cerr << "Unknown record format: " << cmd.get_option("-records") << "\n";
+      return 1;
+    }
+    if (cmd.exists_option("-width")) {
+      const std::string s = cmd.get_option("-width");
+      if (!s.empty() && s.size() < 10 && s.find_first_not_of("0123456789") == std::string::npos)
+        width = std::stoul(s);
+      if (width < sizeof(unsigned)) {
+        std::cerr << "Width of records must be a number of bytes, at least " << sizeof(unsigned) << ": " << s << "\n";
+        return 1;
+      }
+    }
+    for (auto& option : { "--gen1g", "--gen", "-n", "--ref", "--test", "--count", "-manifest", "--resume", "-delta", "-workers", "-worker", "-engine",
+      "-shards", "-index", "-lookup", "-range" })
+      if (cmd.exists_option(option)) {
+        std::cerr << "Option " << option << " is for 32bit elements, not for -records or -width\n";
+        return 1;
+      }
+  }
+
+  if (cmd.exists_option("-engine") && !selectEngine(cmd.get_option("-engine"))) {
+    std::cerr << "Unknown engine: " << cmd.get_option("-engine") << ", one of:";
+    for (auto& engine : engines())
+      std::cerr << " " << engine.name;
+    std::cerr << "\n";
+    return 1;
+  }
+
   std::setlocale(LC_ALL, ".UTF-8");
   std::cout << "Hi, балбесик 😊\n";
 
-  CmdOptions cmd(argc, argv);
+  if (cmd.exists_option("-service")) {
+    ServiceOptions service;
+    service.socket = cmd.get_option("-service");
+    service.command = cmd[0].find('/') != std::string::npos ? absolutePath(cmd[0]) : cmd[0]; // NB: jobs run in other dirs.
+    service.memSize = std::stoull(cmd.get_option("-m", std::to_string(128 * 1024 * 1024UL / sizeof(unsigned)))) * sizeof(unsigned);
+    service.numThreads = cmd.exists_option("-t") ? std::stoi(cmd.get_option("-t")) : int(std::thread::hardware_concurrency());
+    service.maxJobs = std::max(1, std::stoi(cmd.get_option("-jobs", "2")));
+    return runService(service) ? 0 : 1;
+  }
+  if (cmd.exists_option("-stop")) {
+    if (!stopService(cmd.get_option("-stop"))) {
+      std::cerr << "No service on " << cmd.get_option("-stop") << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (cmd.exists_option("-submit")) {
+    // All other args go to the job, its memory and threads are given by the service.
+    std::vector<std::string> args;
+    for (size_t i = 1; i < cmd.size(); i++) {
+      if (cmd[i] == "-submit" || cmd[i] == "-priority" || cmd[i] == "-m" || cmd[i] == "-t")
+        i++;
+      else
+        args.push_back(cmd[i]);
+    }
+    int exitCode = 1;
+    double seconds = 0;
+    if (!submitJob(cmd.get_option("-submit"), std::stoi(cmd.get_option("-priority", "0")), currentDir(), args, exitCode, seconds)) {
+      std::cerr << "No service on " << cmd.get_option("-submit") << "\n";
+      return 1;
+    }
+    std::cout << "Job is done by the service: exit code " << exitCode << ", " << seconds << "sec, see extsort.log\n";
+    return exitCode;
+  }
 
-  const std::string testName = "input";
-  if (cmd.exists_option("--gen1g") || cmd.exists_option("--gen"))
+  const std::string metricsName = cmd.get_option("-metrics");
+  const std::string traceName = cmd.get_option("-trace");
+  if (!metricsName.empty() || !traceName.empty()) {
+    Metrics::get().enable();
+    Metrics::get().nameThread("main");
+  }
+
+  if (cmd.exists_option("-into") && !cmd.exists_option("-delta")) {
+    std::cerr << "Option -into needs -delta\n";
+    return 1;
+  }
+  const bool generate = cmd.exists_option("--gen1g") || cmd.exists_option("--gen") || cmd.exists_option("-n");
+  for (auto& option : { "-dist", "--sorted" })
+    if (!generate && cmd.exists_option(option)) {
+      std::cerr << "Option " << option << " needs --gen, --gen1g or -n\n";
+      return 1;
+    }
+  if (generate)
   {
     Timer timer;
     size_t sz = cmd.exists_option("--gen1g") ? 256 * 1024 * 1024UL : 256;
+    if (cmd.exists_option("-n"))
+      sz = std::stoull(cmd.get_option("-n"));
     std::string sorted;
+    Distribution dist = Distribution::uniform;
+    if (cmd.exists_option("-dist") && !parseDistribution(cmd.get_option("-dist"), dist)) {
+      std::cerr << "Unknown distribution: " << cmd.get_option("-dist") << "\n";
+      return 1;
+    }
     if (cmd.exists_option("--sorted")) {
       sorted = " Sorted.";
       generateSortedFile(testName, sz);
     }
+    else if (cmd.exists_option("-n") || cmd.exists_option("-dist")) {
+      sorted = " " + distributionNames()[int(dist)] + ".";
+      generateFile(testName, sz, dist, std::thread::hardware_concurrency());
+    }
     else
       generateFile1(testName, sz);
     std::cout << "Generate test file: " << timer << "sec. Size:" << sz << sorted << "\n";
   }
 
-  const std::string resultName = "output";
+  Aggregate agg = Aggregate::none;
+  if (cmd.exists_option("--unique"))
+    agg = Aggregate::unique;
+  else if (cmd.exists_option("--count"))
+    agg = Aggregate::count;
   if (cmd.exists_option("--ref")) {
     Timer timer;
     doReferenceSort(testName, resultName);
@@ -39,6 +159,32 @@ int main(int argc, const char* argv[])
     return 0; // No test needed.
   }
 
+  if (cmd.exists_option("-lookup") || cmd.exists_option("-range")) {
+    unsigned lo = 0, hi = 0;
+    if (cmd.exists_option("-lookup"))
+      lo = hi = unsigned(std::stoul(cmd.get_option("-lookup")));
+    else {
+      auto range = cmd.get_option("-range");
+      auto comma = range.find(',');
+      lo = unsigned(std::stoul(range.substr(0, comma)));
+      hi = comma == std::string::npos ? lo : unsigned(std::stoul(range.substr(comma + 1)));
+    }
+    Timer timer;
+    LookupResult res;
+    if (!lookupRange(resultName, lo, hi, res)) {
+      std::cerr << "Cannot read " << resultName << " or its index, sort it with -index N.\n";
+      return 1;
+    }
+    if (res.bloomSkipped)
+      std::cout << "Key " << lo << ": not found by the bloom filter";
+    else if (lo == hi)
+      std::cout << "Key " << lo << ": count " << res.count << " at record " << res.first;
+    else
+      std::cout << "Keys [" << lo << ", " << hi << "]: " << res.records << " records from record " << res.first;
+    std::cout << ", block reads: " << res.blockReads << ", " << timer << "sec\n";
+    return 0;
+  }
+
   {
     size_t memSize = 128 * 1024 * 1024UL;
     if (cmd.exists_option("-m"))
@@ -46,23 +192,83 @@ int main(int argc, const char* argv[])
     int numThreads = std::thread::hardware_concurrency();
     if (cmd.exists_option("-t"))
       numThreads = std::stoi(cmd.get_option("-t"));
+    SortOptions opt;
+    opt.pinThreads = cmd.exists_option("--pin");
+    opt.agg = agg;
+    opt.manifest = cmd.get_option("-manifest", cmd.exists_option("--resume") ? "extsort.manifest" : "");
+    if (cmd.exists_option("-index"))
+      opt.index.every = std::stoull(cmd.get_option("-index"));
+    if (cmd.exists_option("-bloom"))
+      opt.index.bloomBits = std::stoi(cmd.get_option("-bloom"));
+    if (cmd.exists_option("-shards"))
+      opt.shards = std::stoi(cmd.get_option("-shards"));
+    const int numWorkers = std::stoi(cmd.get_option("-workers", "0"));
+    const std::string jobDir = cmd.get_option("-dir", "extsort.job");
+    std::string workerCommand; // Local worker processes, with their shares of memory and threads.
+    if (numWorkers > 0 && !cmd.exists_option("-worker") && !cmd.exists_option("--wait-workers")) {
+      workerCommand = "\"" + cmd[0] + "\" -workers " + std::to_string(numWorkers) + " -dir \"" + jobDir + "\"" +
+        " -i \"" + absolutePath(testName) + "\" -o \"" + absolutePath(resultName) + "\"" +
+        " -m " + std::to_string(memSize / sizeof(unsigned) / numWorkers) + " -t " + std::to_string(std::max(1, numThreads / numWorkers));
+      if (agg == Aggregate::unique)
+        workerCommand += " --unique";
+      else if (agg == Aggregate::count)
+        workerCommand += " --count";
+      if (opt.index.every)
+        workerCommand += " -index " + std::to_string(opt.index.every) + " -bloom " + std::to_string(opt.index.bloomBits);
+      if (opt.pinThreads)
+        workerCommand += " --pin";
+      workerCommand += " -engine " + currentEngine().name;
+    }
     Timer timer;
-    if (cmd.exists_option("-p")) {
-      int numPasses = std::stoi(cmd.get_option("-p"));
-      externalSortNPasses(testName, resultName, memSize, numThreads, numPasses);
+    try {
+      if (cmd.exists_option("--resume")) {
+        if (!resumeExternalSort(opt))
+          return 1;
+        agg = opt.agg;
+      }
+      else if (cmd.exists_option("-records"))
+        sortRecords(testName, resultName, memSize, numThreads, format, agg);
+      else if (cmd.exists_option("-width"))
+        sortWideRecords(testName, resultName, memSize, numThreads, width, agg);
+      else if (cmd.exists_option("-worker"))
+        sortWorker(testName, resultName, memSize, numThreads, std::stoi(cmd.get_option("-worker")), numWorkers, jobDir, opt);
+      else if (numWorkers > 0)
+        sortCoordinator(resultName, numWorkers, jobDir, workerCommand);
+      else if (cmd.exists_option("-delta"))
+        mergeDelta(resultName, cmd.get_option("-delta"), cmd.get_option("-into", resultName), memSize, numThreads, opt);
+      else if (cmd.exists_option("-p")) {
+        int numPasses = std::stoi(cmd.get_option("-p"));
+        externalSortNPasses(testName, resultName, memSize, numThreads, numPasses, opt);
+      }
+      else if (cmd.exists_option("-s")) {
+        int numSlots = std::stoi(cmd.get_option("-s"));
+        externalSort(testName, resultName, memSize, numThreads, numSlots, opt);
+      }
+      else
+        externalSortNPasses(testName, resultName, memSize, numThreads, 0, opt);
     }
-    else if (cmd.exists_option("-s")) {
-      int numSlots = std::stoi(cmd.get_option("-s"));
-      externalSort(testName, resultName, memSize, numThreads, numSlots);
+    catch (const std::runtime_error& e) {
+      std::cerr << e.what() << "\n";
+      return 1;
     }
-    else
-      externalSortNPasses(testName, resultName, memSize, numThreads, 0);
     std::cout << "External sort: " << timer << "sec\n";
   }
 
+  if (!metricsName.empty() && !Metrics::get().writeSummary(metricsName))
+    std::cerr << "Cannot write metrics to " << metricsName << "\n";
+  if (!traceName.empty() && !Metrics::get().writeTrace(traceName))
+    std::cerr << "Cannot write trace to " << traceName << "\n";
+
   if (cmd.exists_option("--test")) {
     Timer timer;
-    auto test = makeTest(testName, resultName) ? "passed"s : "failed"s;
+    std::vector<std::string> results = { resultName };
+    const int shards = cmd.exists_option("-workers") ? std::stoi(cmd.get_option("-workers")) : std::stoi(cmd.get_option("-shards", "0"));
+    if (shards > 1 || cmd.exists_option("-workers")) {
+      results.clear();
+      for (int p = 0; p < shards; p++)
+        results.push_back(shardName(resultName, p));
+    }
+    auto test = makeTest(testName, results, 0, agg) ? "passed"s : "failed"s;
     std::cout << "Check results: " << timer << "sec\n";
     std::cout << "Test " << test << "\n";
   }